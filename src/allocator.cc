@@ -0,0 +1,90 @@
+#include "allocator.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/types.h>
+
+#include <jemalloc/jemalloc.h>
+
+namespace hm::alloc {
+
+template <class T> static int read_ctl(const std::string &name, T &out) {
+  size_t len = sizeof(T);
+  return mallctl(name.c_str(), &out, &len, nullptr, 0);
+}
+
+template <class T> static int write_ctl(const std::string &name, T value) {
+  return mallctl(name.c_str(), nullptr, nullptr, &value, sizeof(T));
+}
+
+int bind_thread_arena(const ArenaConfig &config) {
+  unsigned arena;
+  if (int rv = read_ctl("arenas.create", arena); rv != 0) {
+    std::cerr << "Failed to create jemalloc arena: " << strerror(rv)
+              << std::endl;
+    return -1;
+  }
+
+  auto prefix = "arena." + std::to_string(arena) + ".";
+  write_ctl(prefix + "dirty_decay_ms", (ssize_t)config.dirty_decay_ms);
+  write_ctl(prefix + "muzzy_decay_ms", (ssize_t)config.muzzy_decay_ms);
+
+  if (int rv = write_ctl("thread.arena", arena); rv != 0) {
+    std::cerr << "Failed to bind jemalloc arena: " << strerror(rv)
+              << std::endl;
+    return -1;
+  }
+  write_ctl("thread.tcache.enabled", true);
+  // cached objects belong to the previous arena
+  mallctl("thread.tcache.flush", nullptr, nullptr, nullptr, 0);
+
+  return (int)arena;
+}
+
+void refresh_stats() {
+  uint64_t epoch = 1;
+  size_t len = sizeof(epoch);
+  mallctl("epoch", &epoch, &len, &epoch, len);
+}
+
+std::optional<ArenaStats> get_arena_stats(unsigned arena) {
+  size_t page;
+  if (read_ctl("arenas.page", page) != 0) {
+    return std::nullopt;
+  }
+
+  auto prefix = "stats.arenas." + std::to_string(arena) + ".";
+  size_t small_allocated, large_allocated, pactive, pdirty, pmuzzy;
+  uint64_t small_nmalloc, small_ndalloc, large_nmalloc, large_ndalloc;
+
+  if (read_ctl(prefix + "small.allocated", small_allocated) != 0 ||
+      read_ctl(prefix + "large.allocated", large_allocated) != 0 ||
+      read_ctl(prefix + "pactive", pactive) != 0 ||
+      read_ctl(prefix + "pdirty", pdirty) != 0 ||
+      read_ctl(prefix + "pmuzzy", pmuzzy) != 0 ||
+      read_ctl(prefix + "small.nmalloc", small_nmalloc) != 0 ||
+      read_ctl(prefix + "small.ndalloc", small_ndalloc) != 0 ||
+      read_ctl(prefix + "large.nmalloc", large_nmalloc) != 0 ||
+      read_ctl(prefix + "large.ndalloc", large_ndalloc) != 0) {
+    // jemalloc built without statistics
+    return std::nullopt;
+  }
+
+  return ArenaStats{.small_allocated = small_allocated,
+                    .large_allocated = large_allocated,
+                    .active = pactive * page,
+                    .dirty = pdirty * page,
+                    .muzzy = pmuzzy * page,
+                    .nmalloc = small_nmalloc + large_nmalloc,
+                    .ndalloc = small_ndalloc + large_ndalloc};
+}
+
+int dump_heap_profile(const char *filename) {
+  if (filename) {
+    return write_ctl("prof.dump", filename);
+  }
+  return mallctl("prof.dump", nullptr, nullptr, nullptr, 0);
+}
+
+} // namespace hm::alloc
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+
+// thin wrappers around jemalloc's mallctl interface
+namespace hm::alloc {
+
+struct ArenaConfig {
+  // time unused dirty/muzzy pages are kept before being purged, -1 never
+  int64_t dirty_decay_ms = 10000;
+  int64_t muzzy_decay_ms = 10000;
+};
+
+// Creates a new arena and makes the calling thread allocate from it, with
+// thread cache enabled. Returns the arena index or -1 on failure.
+int bind_thread_arena(const ArenaConfig &config);
+
+struct ArenaStats {
+  // bytes currently allocated by the application
+  uint64_t small_allocated;
+  uint64_t large_allocated;
+  // bytes in active pages, and unused pages not yet returned to the OS
+  uint64_t active;
+  uint64_t dirty;
+  uint64_t muzzy;
+  // cumulative allocation and deallocation requests
+  uint64_t nmalloc;
+  uint64_t ndalloc;
+};
+
+// refreshes jemalloc's statistics snapshot, must precede get_arena_stats()
+void refresh_stats();
+std::optional<ArenaStats> get_arena_stats(unsigned arena);
+
+// Writes a heap profile, to |filename| or jemalloc's default prof_prefix
+// based name if null. Only works if the process was started with profiling
+// enabled (MALLOC_CONF=prof:true). Returns 0 or an errno value.
+int dump_heap_profile(const char *filename = nullptr);
+
+} // namespace hm::alloc
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace hm {
+
+// Bump allocator for memory living as long as a request. The first block is
+// inline, further blocks double in size and everything is freed at once when
+// the arena is destroyed. Individual allocations are never freed, objects
+// placed here must not need their destructor to run.
+class Arena {
+  // header of blocks allocated beyond the inline one
+  struct Block {
+    Block *prev;
+    size_t size;
+  };
+
+  constexpr static size_t inline_size = 512;
+  constexpr static size_t max_block_size = 64 * 1024;
+
+public:
+  Arena() : pos_(inline_), end_(inline_ + inline_size) {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() {
+    while (blocks_) {
+      auto prev = blocks_->prev;
+      std::free(blocks_);
+      blocks_ = prev;
+    }
+  }
+
+  void *alloc(size_t n, size_t align = alignof(std::max_align_t)) {
+    auto p = align_up(pos_, align);
+    if (p + n > end_) {
+      p = align_up(grow(n + align), align);
+    }
+    pos_ = p + n;
+    return p;
+  }
+
+  template <class T, class... Args> T *make(Args &&...args) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "arena objects are never destroyed");
+    return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  // uninitialised, null terminated string of |n| chars
+  char *alloc_string(size_t n) {
+    auto p = static_cast<char *>(alloc(n + 1, 1));
+    p[n] = '\0';
+    return p;
+  }
+
+  std::string_view copy(std::string_view str) {
+    auto p = alloc_string(str.size());
+    std::memcpy(p, str.data(), str.size());
+    return {p, str.size()};
+  }
+
+private:
+  static std::byte *align_up(std::byte *p, size_t align) {
+    auto v = reinterpret_cast<uintptr_t>(p);
+    return p + ((align - v % align) % align);
+  }
+
+  // starts a new block with at least |n| bytes, returns its first byte
+  std::byte *grow(size_t n) {
+    next_size_ = std::min(next_size_ * 2, max_block_size);
+    auto size = std::max(next_size_, n);
+    auto block = static_cast<Block *>(std::malloc(sizeof(Block) + size));
+    if (!block) {
+      throw std::bad_alloc();
+    }
+    block->prev = blocks_;
+    block->size = size;
+    blocks_ = block;
+    pos_ = reinterpret_cast<std::byte *>(block + 1);
+    end_ = pos_ + size;
+    return pos_;
+  }
+
+private:
+  alignas(std::max_align_t) std::byte inline_[inline_size];
+  std::byte *pos_, *end_;
+  Block *blocks_ = nullptr;
+  size_t next_size_ = inline_size;
+};
+
+// std allocator drawing from an Arena, deallocation is a no-op
+template <class T> class ArenaAllocator {
+public:
+  using value_type = T;
+
+  ArenaAllocator(Arena &arena) : arena_(&arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena_) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(arena_->alloc(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *, size_t) {}
+
+  template <class U> bool operator==(const ArenaAllocator<U> &other) const {
+    return arena_ == other.arena_;
+  }
+
+private:
+  template <class U> friend class ArenaAllocator;
+  Arena *arena_;
+};
+
+} // namespace hm
@@ -48,6 +48,9 @@ template <size_t N> struct Buffer {
   // Returns the number of bytes this buffer can store.
   size_t wleft() const { return std::end(buf_) - last_; }
 
+  // Returns the total size of the buffer.
+  constexpr static size_t capacity() { return N; }
+
   // Writes upto min(wleft(), count) bytes from buffer pointed to by src.
   // Returns the number of bytes written.
   size_t write(const void *src, size_t count) {
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "buffer.h"
+#include "hugepages.h"
+
+namespace hm {
+
+using WriteBuffer = Buffer<64 * 1024>;
+using ReadBuffer = std::array<uint8_t, 16 * 1024>;
+
+// Per worker free list of I/O buffers. Sessions only hold a buffer while
+// they are actively reading or writing, idle connections hold none.
+//
+// Unless the mode is OFF, buffers are carved from huge page backed regions
+// so that the buffers of many connections share few TLB entries. A region is
+// only given back once all of its buffers are free.
+template <class T> class BufferPool {
+  // header at the start of every huge page region
+  struct Region {
+    // buffers of this region in free_
+    size_t free;
+  };
+
+  constexpr static size_t region_offset =
+      (sizeof(Region) + alignof(T) - 1) / alignof(T) * alignof(T);
+  constexpr static size_t region_capacity =
+      (huge_page_size - region_offset) / sizeof(T);
+
+  static_assert(region_capacity > 0);
+
+public:
+  explicit BufferPool(HugePageMode mode = HugePageMode::OFF) : mode_(mode) {}
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  ~BufferPool() {
+    if (mode_ == HugePageMode::OFF) {
+      for (auto buf : free_) {
+        delete buf;
+      }
+    } else {
+      for (auto region : regions_) {
+        unmap_region(region);
+      }
+    }
+  }
+
+  T *acquire() {
+    if (free_.empty()) {
+      grow();
+    }
+    auto buf = free_.back();
+    free_.pop_back();
+    if (mode_ != HugePageMode::OFF) {
+      region_of(buf)->free--;
+    }
+    peak_ = std::max(peak_, ++in_use_);
+    return buf;
+  }
+
+  void release(T *buf) {
+    assert(in_use_ > 0);
+    in_use_--;
+    free_.push_back(buf);
+    if (mode_ != HugePageMode::OFF) {
+      region_of(buf)->free++;
+    }
+  }
+
+  // Frees buffers not needed to serve the peak usage since last trim.
+  void trim() {
+    auto keep = peak_ - in_use_;
+    if (mode_ == HugePageMode::OFF) {
+      while (free_.size() > keep) {
+        delete free_.back();
+        free_.pop_back();
+      }
+    } else {
+      std::erase_if(regions_, [&](Region *region) {
+        if (region->free < region_capacity ||
+            free_.size() < keep + region_capacity) {
+          return false;
+        }
+        std::erase_if(free_,
+                      [&](T *buf) { return region_of(buf) == region; });
+        unmap_region(region);
+        return true;
+      });
+    }
+    free_.shrink_to_fit();
+    peak_ = in_use_;
+  }
+
+  size_t in_use() const { return in_use_; }
+  size_t pooled() const { return free_.size(); }
+
+private:
+  static Region *region_of(T *buf) {
+    auto addr = reinterpret_cast<uintptr_t>(buf);
+    return reinterpret_cast<Region *>(addr & ~(huge_page_size - 1));
+  }
+
+  static T *region_buffer(Region *region, size_t i) {
+    auto base = reinterpret_cast<std::byte *>(region) + region_offset;
+    return std::launder(reinterpret_cast<T *>(base + i * sizeof(T)));
+  }
+
+  void grow() {
+    if (mode_ == HugePageMode::OFF) {
+      free_.push_back(new T);
+      return;
+    }
+    auto p = map_huge_pages(huge_page_size, mode_);
+    if (!p) {
+      throw std::bad_alloc();
+    }
+    auto region = new (p) Region{.free = region_capacity};
+    auto base = static_cast<std::byte *>(p) + region_offset;
+    // reverse, so buffers are handed out in address order
+    for (size_t i = region_capacity; i-- > 0;) {
+      free_.push_back(new (base + i * sizeof(T)) T);
+    }
+    regions_.push_back(region);
+  }
+
+  static void unmap_region(Region *region) {
+    for (size_t i = 0; i < region_capacity; i++) {
+      region_buffer(region, i)->~T();
+    }
+    unmap_huge_pages(region, huge_page_size);
+  }
+
+private:
+  HugePageMode mode_;
+  std::vector<T *> free_;
+  std::vector<Region *> regions_;
+  size_t in_use_ = 0;
+  size_t peak_ = 0;
+};
+
+} // namespace hm
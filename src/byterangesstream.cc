@@ -0,0 +1,65 @@
+#include "byterangesstream.h"
+#include "stream.h"
+
+namespace hm {
+
+ByteRangesStream::ByteRangesStream(std::shared_ptr<FileEntry> file_entry,
+                                   Stream *stream,
+                                   const std::vector<util::ByteRange> &ranges,
+                                   std::string boundary)
+    : stream_(stream), file_(std::move(file_entry)) {
+  auto size = std::to_string(file_->info().length);
+  for (auto &range : ranges) {
+    auto &part = parts_.emplace_back();
+    part.range = range;
+    // the CRLF before the first delimiter is an empty preamble
+    part.head = "\r\n--" + boundary + "\r\ncontent-type: ";
+    part.head += file_->mime_type();
+    part.head += "\r\ncontent-range: bytes " + std::to_string(range.offset) +
+                 "-" + std::to_string(range.offset + range.length - 1) + "/" +
+                 size + "\r\n\r\n";
+    length_ += part.head.size() + range.length;
+  }
+  tail_ = "\r\n--" + boundary + "--\r\n";
+  length_ += tail_.size();
+  content_type_ = "multipart/byteranges; boundary=" + boundary;
+}
+
+std::pair<size_t, bool> ByteRangesStream::remaining() {
+  while (part_ < parts_.size()) {
+    auto &part = parts_[part_];
+    if (head_pos_ < part.head.size()) {
+      return {part.head.size() - head_pos_, false};
+    }
+    if (!body_) {
+      body_.emplace(file_, stream_, part.range.offset, part.range.length);
+    }
+    if (body_->offset() < body_->length()) {
+      // deferred while the range is read, or failed()
+      return {body_->remaining().first, false};
+    }
+    body_.reset();
+    part_++;
+    head_pos_ = 0;
+  }
+  return {tail_.size() - head_pos_, true};
+}
+
+int ByteRangesStream::send(Stream *stream, size_t length) {
+  pos_ += length;
+  const std::string *literal = nullptr;
+  if (part_ == parts_.size()) {
+    literal = &tail_;
+  } else if (head_pos_ < parts_[part_].head.size()) {
+    literal = &parts_[part_].head;
+  } else {
+    return body_->send(stream, length);
+  }
+
+  assert(head_pos_ + length <= literal->size());
+  stream->get_buffer()->write_full(literal->data() + head_pos_, length);
+  head_pos_ += length;
+  return 0;
+}
+
+} // namespace hm
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "datastream.h"
+#include "fileentry.h"
+#include "filestream.h"
+#include "util.h"
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace hm {
+
+// multipart/byteranges body of several ranges of a file, each read by a
+// FileStream in turn
+class ByteRangesStream : public DataStream {
+
+public:
+  ByteRangesStream(std::shared_ptr<FileEntry> file_entry, Stream *stream,
+                   const std::vector<util::ByteRange> &ranges,
+                   std::string boundary);
+
+  int send(Stream *stream, size_t length) override;
+
+  size_t length() override { return length_; }
+  size_t offset() override { return pos_; }
+  std::pair<size_t, bool> remaining() override;
+  bool failed() override { return body_ && body_->failed(); }
+
+  // content-type of the response
+  std::string_view content_type() const { return content_type_; }
+
+private:
+  struct Part {
+    // boundary and headers preceding the range
+    std::string head;
+    util::ByteRange range;
+  };
+
+  std::vector<Part> parts_;
+  // closing boundary
+  std::string tail_;
+  std::string content_type_;
+  // part being sent, parts_.size() once at the tail
+  size_t part_ = 0;
+  // bytes of the part's head, or of the tail, sent
+  size_t head_pos_ = 0;
+  std::optional<FileStream> body_;
+
+  size_t length_ = 0;
+  size_t pos_ = 0;
+  Stream *stream_;
+  std::shared_ptr<FileEntry> file_;
+};
+} // namespace hm
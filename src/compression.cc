@@ -0,0 +1,303 @@
+#include "compression.h"
+
+#include <algorithm>
+#include <charconv>
+#include <utility>
+
+#include <brotli/encode.h>
+#include <zlib.h>
+
+#include "util.h"
+
+namespace hm {
+
+std::string_view encoding_name(ContentEncoding encoding) {
+  switch (encoding) {
+  case ContentEncoding::BR:
+    return "br";
+  case ContentEncoding::ZSTD:
+    return "zstd";
+  case ContentEncoding::GZIP:
+    return "gzip";
+  case ContentEncoding::IDENTITY:
+    break;
+  }
+  return "";
+}
+
+std::optional<ContentEncoding> encoding_from_ext(std::string_view ext) {
+  if (ext == "br") {
+    return ContentEncoding::BR;
+  }
+  if (ext == "zst") {
+    return ContentEncoding::ZSTD;
+  }
+  if (ext == "gz" || ext == "gzip") {
+    return ContentEncoding::GZIP;
+  }
+  return std::nullopt;
+}
+
+namespace {
+
+std::string_view trim(std::string_view str) {
+  auto beg = str.find_first_not_of(" \t");
+  if (beg == str.npos) {
+    return {};
+  }
+  auto end = str.find_last_not_of(" \t");
+  return str.substr(beg, end - beg + 1);
+}
+
+// "q=0.5" among the parameters of a coding, 1 if there is none
+float parse_quality(std::string_view params) {
+  float q = 1.f;
+  while (!params.empty()) {
+    auto end = params.find(';');
+    auto param = trim(params.substr(0, end));
+    params = end == params.npos ? "" : params.substr(end + 1);
+    if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') &&
+        param[1] == '=') {
+      auto value = param.substr(2);
+      if (std::from_chars(value.data(), value.data() + value.size(), q).ec !=
+          std::errc{}) {
+        q = 0.f;
+      }
+    }
+  }
+  return std::clamp(q, 0.f, 1.f);
+}
+
+} // namespace
+
+AcceptEncoding AcceptEncoding::parse(std::optional<std::string_view> header) {
+  AcceptEncoding accept;
+  if (!header) {
+    return accept;
+  }
+
+  std::array<bool, num_content_encodings> listed{};
+  std::optional<float> any;
+  auto str = *header;
+  while (!str.empty()) {
+    auto end = str.find(',');
+    auto item = str.substr(0, end);
+    str = end == str.npos ? "" : str.substr(end + 1);
+
+    auto params = item.find(';');
+    auto name = trim(item.substr(0, params));
+    auto q = params == item.npos ? 1.f : parse_quality(item.substr(params + 1));
+
+    std::optional<ContentEncoding> encoding;
+    if (util::streq_l("br", name)) {
+      encoding = ContentEncoding::BR;
+    } else if (util::streq_l("zstd", name)) {
+      encoding = ContentEncoding::ZSTD;
+    } else if (util::streq_l("gzip", name) || util::streq_l("x-gzip", name)) {
+      encoding = ContentEncoding::GZIP;
+    } else if (util::streq_l("identity", name)) {
+      encoding = ContentEncoding::IDENTITY;
+    } else if (name == "*") {
+      any = q;
+    }
+    if (encoding) {
+      accept.q_[(size_t)*encoding] = q;
+      listed[(size_t)*encoding] = true;
+    }
+  }
+
+  // "*" covers the codings not listed, identity stays acceptable unless
+  // excluded explicitly
+  for (size_t i = 0; i < num_content_encodings; i++) {
+    if (!listed[i] && any) {
+      accept.q_[i] = *any;
+    }
+  }
+  return accept;
+}
+
+bool is_compressible(std::string_view mime_type) {
+  if (mime_type.starts_with("text/")) {
+    return true;
+  }
+  for (auto part : {"javascript", "json", "xml", "wasm", "font/ttf",
+                    "font/otf", "ms-fontobject"}) {
+    if (mime_type.find(part) != mime_type.npos) {
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace {
+
+std::optional<std::string> compress_brotli(std::string_view data) {
+  std::string out(BrotliEncoderMaxCompressedSize(data.size()), '\0');
+  auto size = out.size();
+  if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_MODE_GENERIC, data.size(),
+                             reinterpret_cast<const uint8_t *>(data.data()),
+                             &size, reinterpret_cast<uint8_t *>(out.data()))) {
+    return std::nullopt;
+  }
+  out.resize(size);
+  return out;
+}
+
+std::optional<std::string> compress_gzip(std::string_view data) {
+  z_stream zs{};
+  // 16 + window bits for the gzip wrapper
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 9,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return std::nullopt;
+  }
+  std::string out(deflateBound(&zs, data.size()) + 32, '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+  zs.avail_in = data.size();
+  zs.next_out = reinterpret_cast<Bytef *>(out.data());
+  zs.avail_out = out.size();
+  auto rv = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  if (rv != Z_STREAM_END) {
+    return std::nullopt;
+  }
+  return out;
+}
+
+} // namespace
+
+std::optional<std::string> compress(ContentEncoding encoding,
+                                    std::string_view data) {
+  switch (encoding) {
+  case ContentEncoding::BR:
+    return compress_brotli(data);
+  case ContentEncoding::GZIP:
+    return compress_gzip(data);
+  default:
+    return std::nullopt;
+  }
+}
+
+Compressor::Compressor(Compressor &&other) noexcept
+    : encoding_(other.encoding_), zs_(other.zs_), br_(other.br_),
+      done_(other.done_) {
+  other.zs_ = nullptr;
+  other.br_ = nullptr;
+}
+
+Compressor &Compressor::operator=(Compressor &&other) noexcept {
+  if (this != &other) {
+    reset();
+    encoding_ = other.encoding_;
+    zs_ = std::exchange(other.zs_, nullptr);
+    br_ = std::exchange(other.br_, nullptr);
+    done_ = other.done_;
+  }
+  return *this;
+}
+
+Compressor::~Compressor() { reset(); }
+
+void Compressor::reset() {
+  if (zs_) {
+    deflateEnd(zs_);
+    delete zs_;
+    zs_ = nullptr;
+  }
+  if (br_) {
+    BrotliEncoderDestroyInstance(br_);
+    br_ = nullptr;
+  }
+}
+
+bool Compressor::compress(std::string_view &in, std::span<uint8_t> &out,
+                          bool finish) {
+  if (zs_) {
+    zs_->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+    zs_->avail_in = in.size();
+    zs_->next_out = out.data();
+    zs_->avail_out = out.size();
+    auto rv = deflate(zs_, finish ? Z_FINISH : Z_NO_FLUSH);
+    if (rv == Z_STREAM_ERROR) {
+      return false;
+    }
+    done_ = rv == Z_STREAM_END;
+    in.remove_prefix(in.size() - zs_->avail_in);
+    out = out.subspan(out.size() - zs_->avail_out);
+    return true;
+  }
+  if (br_) {
+    auto avail_in = in.size();
+    auto next_in = reinterpret_cast<const uint8_t *>(in.data());
+    auto avail_out = out.size();
+    auto next_out = out.data();
+    if (!BrotliEncoderCompressStream(
+            br_, finish ? BROTLI_OPERATION_FINISH : BROTLI_OPERATION_PROCESS,
+            &avail_in, &next_in, &avail_out, &next_out, nullptr)) {
+      return false;
+    }
+    done_ = BrotliEncoderIsFinished(br_);
+    in.remove_prefix(in.size() - avail_in);
+    out = out.subspan(out.size() - avail_out);
+    return true;
+  }
+  return false;
+}
+
+CompressorPool::~CompressorPool() {
+  for (auto zs : idle_gzip_) {
+    deflateEnd(zs);
+    delete zs;
+  }
+}
+
+std::optional<Compressor> CompressorPool::get(ContentEncoding encoding, int level) {
+  Compressor compressor;
+  compressor.encoding_ = encoding;
+
+  if (encoding == ContentEncoding::BR) {
+    auto br = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+    if (br) {
+      BrotliEncoderSetParameter(br, BROTLI_PARAM_QUALITY,
+                                std::clamp(level, BROTLI_MIN_QUALITY,
+                                           BROTLI_MAX_QUALITY));
+      BrotliEncoderSetParameter(br, BROTLI_PARAM_LGWIN, br_window_bits);
+      compressor.br_ = br;
+      return compressor;
+    }
+    return std::nullopt;
+  }
+
+  level = std::clamp(level, 1, 9);
+  if (!idle_gzip_.empty()) {
+    auto zs = idle_gzip_.back();
+    idle_gzip_.pop_back();
+    // parameters can change before the first deflate() call
+    if (deflateReset(zs) == Z_OK &&
+        deflateParams(zs, level, Z_DEFAULT_STRATEGY) == Z_OK) {
+      compressor.zs_ = zs;
+      return compressor;
+    }
+    deflateEnd(zs);
+    delete zs;
+  }
+  auto zs = new z_stream{};
+  // 16 + window bits for the gzip wrapper
+  if (deflateInit2(zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    delete zs;
+    return std::nullopt;
+  }
+  compressor.zs_ = zs;
+  return compressor;
+}
+
+void CompressorPool::put(Compressor &&compressor) {
+  if (compressor.zs_ && idle_gzip_.size() < max_idle) {
+    idle_gzip_.push_back(std::exchange(compressor.zs_, nullptr));
+  }
+  compressor.reset();
+}
+
+} // namespace hm
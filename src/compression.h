@@ -0,0 +1,119 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct z_stream_s;
+struct BrotliEncoderStateStruct;
+
+namespace hm {
+
+// content codings, in order of the server's preference
+enum class ContentEncoding : uint8_t { BR, ZSTD, GZIP, IDENTITY };
+
+constexpr size_t num_content_encodings = 4;
+
+// value of the content-encoding header, empty for IDENTITY
+std::string_view encoding_name(ContentEncoding encoding);
+// extension of precompressed files, e.g. "br" for "index.html.br"
+std::optional<ContentEncoding> encoding_from_ext(std::string_view ext);
+
+// codings a client accepts, from its Accept-Encoding header
+class AcceptEncoding {
+public:
+  // identity only
+  AcceptEncoding() { q_[(size_t)ContentEncoding::IDENTITY] = 1.f; }
+
+  // a missing header accepts identity only
+  static AcceptEncoding parse(std::optional<std::string_view> header);
+
+  // quality value of |encoding|, 0 if not acceptable
+  float quality(ContentEncoding encoding) const {
+    return q_[(size_t)encoding];
+  }
+  bool accepts(ContentEncoding encoding) const {
+    return quality(encoding) > 0.f;
+  }
+  // true if |a| is preferred over |b|: higher quality, then server order
+  bool prefers(ContentEncoding a, ContentEncoding b) const {
+    return quality(a) != quality(b) ? quality(a) > quality(b) : a < b;
+  }
+
+private:
+  std::array<float, num_content_encodings> q_{};
+};
+
+// worth compressing: text, scripts, json, xml, svg and so on
+bool is_compressible(std::string_view mime_type);
+
+// |data| compressed with |encoding| (BR or GZIP) at the highest level,
+// nullopt if it failed or isn't supported
+std::optional<std::string> compress(ContentEncoding encoding,
+                                    std::string_view data);
+
+// on the fly compression of dynamic responses
+struct CompressPolicy {
+  bool enabled = true;
+  // smaller bodies are sent as is
+  size_t min_size = 1024;
+  // 0-11 and 1-9, low levels keep up with the handlers
+  int br_level = 4;
+  int gzip_level = 6;
+};
+
+// Streaming compressor of one response, taken from a CompressorPool.
+class Compressor {
+public:
+  Compressor() = default;
+  Compressor(Compressor &&other) noexcept;
+  Compressor &operator=(Compressor &&other) noexcept;
+  ~Compressor();
+
+  ContentEncoding encoding() const { return encoding_; }
+
+  // Compresses from |in| into |out|, advancing both. |finish| once |in|
+  // holds the rest of the input. Returns false on error.
+  bool compress(std::string_view &in, std::span<uint8_t> &out, bool finish);
+  // everything was written out after finishing
+  bool done() const { return done_; }
+
+private:
+  friend class CompressorPool;
+
+  void reset();
+
+  ContentEncoding encoding_ = ContentEncoding::IDENTITY;
+  z_stream_s *zs_ = nullptr;
+  BrotliEncoderStateStruct *br_ = nullptr;
+  bool done_ = false;
+};
+
+// Idle compression contexts of a worker. Deflate state is large and is
+// reset for reuse, brotli encoders can't be reset and are created per
+// response.
+class CompressorPool {
+public:
+  constexpr static size_t max_idle = 16;
+  // history kept by brotli encoders, 2^18 bytes
+  constexpr static int br_window_bits = 18;
+
+  CompressorPool() = default;
+  CompressorPool(const CompressorPool &) = delete;
+  CompressorPool &operator=(const CompressorPool &) = delete;
+  ~CompressorPool();
+
+  // compressor for |encoding|, BR or GZIP, at |level|
+  std::optional<Compressor> get(ContentEncoding encoding, int level);
+  void put(Compressor &&compressor);
+
+private:
+  std::vector<z_stream_s *> idle_gzip_;
+};
+
+} // namespace hm
@@ -0,0 +1,50 @@
+#include "compressstream.h"
+#include "stream.h"
+
+#include <iostream>
+
+namespace hm {
+
+CompressStream::CompressStream(DataStream *source, Compressor &&compressor,
+                               CompressorPool *pool)
+    : source_(source), compressor_(std::move(compressor)), pool_(pool),
+      out_(std::make_unique<uint8_t[]>(window_size)) {}
+
+CompressStream::~CompressStream() { pool_->put(std::move(compressor_)); }
+
+std::pair<size_t, bool> CompressStream::remaining() {
+  if (out_pos_ == out_len_ && !compressor_.done() && !failed_) {
+    out_pos_ = out_len_ = 0;
+    if (!fill()) {
+      std::cerr << "Compressing response failed" << std::endl;
+      failed_ = true;
+    }
+  }
+  // never deferred, fill() produces output, finishes or failed()
+  return {out_len_ - out_pos_, compressor_.done()};
+}
+
+bool CompressStream::fill() {
+  std::span<uint8_t> out(out_.get(), window_size);
+  while (!out.empty() && !compressor_.done()) {
+    if (in_.empty() && !source_done_) {
+      in_ = source_->read(chunk_size);
+      source_done_ = in_.empty();
+    }
+    if (!compressor_.compress(in_, out, source_done_)) {
+      return false;
+    }
+  }
+  out_len_ = window_size - out.size();
+  return true;
+}
+
+int CompressStream::send(Stream *stream, size_t length) {
+  assert(out_pos_ + length <= out_len_);
+  stream->get_buffer()->write_full(out_.get() + out_pos_, length);
+  out_pos_ += length;
+  sent_ += length;
+  return 0;
+}
+
+} // namespace hm
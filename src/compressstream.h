@@ -0,0 +1,53 @@
+#pragma once
+
+#include "compression.h"
+#include "datastream.h"
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace hm {
+
+// Compresses another stream's body while it is sent, a window at a time.
+// The compressed length is only known at the end, so responses carry no
+// content-length.
+class CompressStream : public DataStream {
+
+public:
+  // compressed output buffered between frames
+  constexpr static size_t window_size = 16384;
+  // input taken from the source at once
+  constexpr static size_t chunk_size = 65536;
+
+  // |source| must outlive this stream, |compressor| goes back to |pool|
+  CompressStream(DataStream *source, Compressor &&compressor,
+                 CompressorPool *pool);
+  ~CompressStream();
+
+  int send(Stream *stream, size_t length) override;
+
+  // bytes produced so far
+  size_t length() override { return sent_ + (out_len_ - out_pos_); }
+  size_t offset() override { return sent_; }
+  std::pair<size_t, bool> remaining() override;
+  bool failed() override { return failed_; }
+
+private:
+  // compresses input until the window is full or the body ends
+  bool fill();
+
+  DataStream *source_;
+  Compressor compressor_;
+  CompressorPool *pool_;
+  // input taken from the source, not consumed yet
+  std::string_view in_;
+  bool source_done_ = false;
+  bool failed_ = false;
+
+  std::unique_ptr<uint8_t[]> out_;
+  size_t out_pos_ = 0;
+  size_t out_len_ = 0;
+  size_t sent_ = 0;
+};
+} // namespace hm
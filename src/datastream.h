@@ -3,6 +3,7 @@
 #include <cstdint>
 #include <cstdlib>
 #include <memory>
+#include <string_view>
 
 namespace hm {
 class Stream;
@@ -13,8 +14,16 @@ struct DataStream {
   DataStream &operator=(const DataStream &) = delete;
 
   virtual int send(Stream *stream, size_t length) = 0;
+  // bytes of the session write buffer send() needs for |length| bytes
+  virtual size_t buffer_usage(Stream *stream, size_t length) { return length; }
   virtual size_t length() = 0;
   virtual size_t offset() = 0;
   virtual std::pair<size_t, bool> remaining() = 0;
+  // the body can't be produced (e.g. a read failed), checked after
+  // remaining(), the stream is reset instead of ended
+  virtual bool failed() { return false; }
+  // Takes up to |length| bytes of the body for a stream wrapping this one
+  // (see CompressStream), empty at the end. Valid until the next call.
+  virtual std::string_view read(size_t length) { return {}; }
 };
 } // namespace hm
@@ -0,0 +1,78 @@
+#include "filecache.h"
+
+#include <algorithm>
+
+#include "worker.h"
+
+namespace hm {
+
+FileCache::FileCache(size_t budget, size_t max_file_size)
+    : budget_(budget), max_file_size_(std::min(max_file_size, budget)) {}
+
+std::shared_ptr<const std::string>
+FileCache::get(const std::shared_ptr<FileEntry> &file) {
+  if (static_cast<size_t>(file->info().length) > max_file_size_) {
+    return nullptr;
+  }
+
+  auto &stats = Worker::get_worker()->get_stats();
+  if (auto contents = file->contents_.load(std::memory_order_acquire)) {
+    // avoid dirtying the line when already set
+    if (!file->referenced_.load(std::memory_order_relaxed)) {
+      file->referenced_.store(true, std::memory_order_relaxed);
+    }
+    stats.file_cache_hits.inc();
+    return contents;
+  }
+  stats.file_cache_misses.inc();
+
+  // the first request only marks the file, one-off requests don't evict
+  // hot files
+  if (!file->referenced_.exchange(true, std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  // the read may block, requests are sent from the file until it's done
+  if (!file->loading_.exchange(true, std::memory_order_relaxed)) {
+    Worker::get_worker()->get_io_pool()->submit(
+        [this, file] { admit(file); });
+  }
+  return nullptr;
+}
+
+void FileCache::admit(const std::shared_ptr<FileEntry> &file) {
+  auto data = file->read();
+  if (!data) {
+    // truncated since it was opened, a new entry will replace it
+    return;
+  }
+  auto contents = std::make_shared<const std::string>(std::move(*data));
+
+  std::lock_guard lock(mutex_);
+  evict(contents->size());
+  file->contents_.store(contents, std::memory_order_release);
+  ring_.push_back({file, contents->size()});
+  used_ += contents->size();
+}
+
+void FileCache::evict(size_t size) {
+  while (used_ + size > budget_ && !ring_.empty()) {
+    hand_ %= ring_.size();
+    auto &slot = ring_[hand_];
+    auto file = slot.file.lock();
+    if (file && file->referenced_.exchange(false, std::memory_order_relaxed)) {
+      // second chance
+      hand_++;
+      continue;
+    }
+    if (file) {
+      // streams sending it keep their reference
+      file->contents_.store(nullptr, std::memory_order_release);
+      file->loading_.store(false, std::memory_order_relaxed);
+    }
+    used_ -= slot.size;
+    slot = std::move(ring_.back());
+    ring_.pop_back();
+  }
+}
+
+} // namespace hm
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fileentry.h"
+
+namespace hm {
+
+// Contents of small, frequently requested static files kept in memory for
+// all workers, so they are sent without reading the file. A file is read
+// on the worker's IoPool on its second request, and evicted with CLOCK once
+// the byte budget is exceeded. Hits are lock-free.
+class FileCache {
+public:
+  // |budget| bytes for files up to |max_file_size|, 0 disables the cache
+  FileCache(size_t budget, size_t max_file_size);
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+
+  // Contents of |file| if cached, nullptr if it is to be read from the file.
+  // Called by workers.
+  std::shared_ptr<const std::string>
+  get(const std::shared_ptr<FileEntry> &file);
+
+private:
+  struct Slot {
+    // replaced entries are dropped when the hand reaches them
+    std::weak_ptr<FileEntry> file;
+    size_t size;
+  };
+
+  // reads |file| and inserts it, runs on an IoPool thread
+  void admit(const std::shared_ptr<FileEntry> &file);
+  // makes room for |size| more bytes, called with mutex_ held
+  void evict(size_t size);
+
+  size_t budget_;
+  size_t max_file_size_;
+
+  std::mutex mutex_;
+  std::vector<Slot> ring_;
+  size_t hand_ = 0;
+  size_t used_ = 0;
+};
+
+} // namespace hm
@@ -1,104 +1,177 @@
 #include <fcntl.h>
 
 #include <cassert>
+#include <cerrno>
 #include <iostream>
 #include <string_view>
 
-#include <ev.h>
-#include <nghttp2/nghttp2.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-#include "filestream.h"
-#include "stream.h"
+#include <openssl/evp.h>
+
+#include "fileentry.h"
 #include "util.h"
-#include "worker.h"
 
 namespace hm {
 
-FileEntry::FileEntry(int fd, std::string p, Worker *worker, bool watch)
-    : fd_(fd), path_(std::move(p)), worker_(worker), compressed_(false),
-      watch_(watch), encoding_("\0") {
+using DigestContext = util::unique_ptr<EVP_MD_CTX>;
+
+static DigestContext digest_init() {
+  auto ctx = DigestContext(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+  EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+  return ctx;
+}
 
-  relpath_ = path_.substr(worker_->get_static_root().size() - 1);
+// hex of the first 16 bytes of the SHA-256
+static std::string digest_hex(DigestContext &ctx) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  EVP_DigestFinal_ex(ctx.get(), md, nullptr);
+  constexpr char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (int i = 0; i < 16; i++) {
+    hex += digits[md[i] >> 4];
+    hex += digits[md[i] & 0xf];
+  }
+  return hex;
+}
+
+// digest of |fd|'s contents, empty if reading it failed
+static std::string hash_contents(int fd, size_t length) {
+  auto ctx = digest_init();
+
+  auto buf = std::make_unique<char[]>(64 << 10);
+  size_t pos = 0;
+  while (pos < length) {
+    auto nread = pread(fd, buf.get(), std::min<size_t>(64 << 10, length - pos),
+                       pos);
+    if (nread == -1 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      return {};
+    }
+    EVP_DigestUpdate(ctx.get(), buf.get(), nread);
+    pos += nread;
+  }
+  return digest_hex(ctx);
+}
+
+FileEntry::FileEntry(int fd, std::string p, size_t root_len)
+    : fd_(fd), path_(std::move(p)), encoding_(ContentEncoding::IDENTITY) {
+
+  relpath_ = path_.substr(root_len);
   assert(fd >= 0);
   set_ext(path_);
   check_if_compressed(path_);
   set_mime_type(path_);
-  // if (compressed()) {
-  //   std::cout << "file: " << path() << std::endl
-  //             << "ext: " << ext() << std::endl
-  //             << "encoding: " << encoding() << std::endl
-  //             << "mime_type: " << mime_type() << std::endl;
-  // }
 
   struct stat st;
   fstat(fd_, &st);
 
   info_ = {.mtime = st.st_mtime, .length = st.st_size};
-
-  if (watch_) {
-    stat_watcher_ = static_cast<ev_stat *>(malloc(sizeof(ev_stat)));
-    ev_stat_init(stat_watcher_, update_cb, path_.c_str(), 0.0);
-    stat_watcher_->data = this;
-    ev_stat_start(worker_->get_loop(), stat_watcher_);
-  }
+  set_validators(st);
 }
 
-std::unique_ptr<FileEntry> FileEntry::create(std::string path, Worker *worker,
-                                             bool watch) {
+std::shared_ptr<FileEntry> FileEntry::create(std::string path,
+                                             size_t root_len) {
   int fd = open(path.c_str(), O_RDONLY);
   if (fd == -1) {
     std::cerr << "Failed to open file: " << path << std::endl;
     return nullptr;
   }
-  return std::unique_ptr<FileEntry>(
-      new FileEntry(fd, std::move(path), worker, watch));
+  return std::shared_ptr<FileEntry>(
+      new FileEntry(fd, std::move(path), root_len));
 }
 
-FileEntry::~FileEntry() {
-  // std::cout << "File removed: " << path_ << std::endl;
-  if (watch_) {
-    ev_stat_stop(worker_->get_loop(), stat_watcher_);
-    free(stat_watcher_);
-    close(fd_);
+FileEntry::FileEntry(int fd, std::shared_ptr<FileEntry> source,
+                     ContentEncoding encoding)
+    : fd_(fd), relpath_(source->relpath_), ext_(source->ext_),
+      mime_type_(source->mime_type_), compressible_(source->compressible_),
+      encoding_(encoding),
+      source_(std::move(source)) {
+  // same path a precompressed file would have, one found on disk later
+  // replaces this variant
+  path_ = source_->path_ + "." + std::string(encoding_name(encoding));
+
+  struct stat st;
+  fstat(fd_, &st);
+
+  info_ = {.mtime = source_->info_.mtime, .length = st.st_size};
+  set_validators(st);
+  // made by the compressor, in memory and off the workers
+  if (auto tag = hash_contents(fd_, info_.length); !tag.empty()) {
+    etag_ = "\"" + tag + "\"";
+    hashed_ = true;
   }
 }
 
-void FileEntry::update_cb(struct ev_loop *loop, ev_stat *w, int revents) {
-  // std::cerr << "File updated: " << w->path << std::endl;
-  auto self = static_cast<FileEntry *>(w->data);
-  if (w->attr.st_nlink) {
-    self->update_info(
-        FileInfo{.mtime = w->attr.st_mtime, .length = w->attr.st_size});
-  } else {
-    self->remove_self();
+FileEntry::FileEntry(int fd, const FileEntry &file, std::string etag)
+    : fd_(fd), path_(file.path_), relpath_(file.relpath_), ext_(file.ext_),
+      mime_type_(file.mime_type_), compressible_(file.compressible_),
+      encoding_(file.encoding_), source_(file.source_), info_(file.info_),
+      etag_(std::move(etag)), hashed_(true), stat_tag_(file.stat_tag_),
+      content_length_(file.content_length_),
+      last_modified_(file.last_modified_) {}
+
+std::shared_ptr<FileEntry> FileEntry::create_hashed(const FileEntry &file) {
+  auto tag = hash_contents(file.fd_, file.info_.length);
+  if (tag.empty()) {
+    return nullptr;
+  }
+  // the copy needs its own descriptor of the same open file
+  int fd = fcntl(file.fd_, F_DUPFD_CLOEXEC, 0);
+  if (fd == -1) {
+    std::cerr << "Failed to duplicate fd of: " << file.path_ << std::endl;
+    return nullptr;
   }
+  return std::shared_ptr<FileEntry>(
+      new FileEntry(fd, file, "\"" + tag + "\""));
+}
+
+std::shared_ptr<FileEntry>
+FileEntry::create_variant(int fd, std::shared_ptr<FileEntry> source,
+                          ContentEncoding encoding) {
+  return std::shared_ptr<FileEntry>(
+      new FileEntry(fd, std::move(source), encoding));
 }
 
-const FileEntry::FileInfo &FileEntry::info() {
-  bool tr = true;
-  if (updated_.compare_exchange_strong(tr, false)) {
-    // updated
-    // std::cout << "File info updated: " << path_ << std::endl;
-    info_ = new_info_;
+FileEntry::~FileEntry() { close(fd_); }
+
+std::optional<std::string> FileEntry::read() const {
+  std::string contents(info_.length, '\0');
+  size_t pos = 0;
+  while (pos < contents.size()) {
+    auto nread =
+        pread(fd_, contents.data() + pos, contents.size() - pos, pos);
+    if (nread == -1 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      return std::nullopt;
+    }
+    pos += nread;
   }
-  return info_;
+  return contents;
 }
 
-void FileEntry::update_info(const FileEntry::FileInfo &info) {
-  new_info_ = info;
-  updated_.store(true);
+void FileEntry::set_validators(const struct stat &st) {
+  content_length_ = std::to_string(info_.length);
+  last_modified_ = util::http_date(info_.mtime);
+
+  // size, modification time in ns and inode change with the contents all
+  // the same, and cost no read
+  int64_t id[] = {info_.length, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                  (int64_t)st.st_ino};
+  auto ctx = digest_init();
+  EVP_DigestUpdate(ctx.get(), id, sizeof(id));
+  stat_tag_ = digest_hex(ctx);
+  etag_ = "\"" + stat_tag_ + "\"";
 }
 
 void FileEntry::check_if_compressed(const std::string_view &path) {
-  if (ext_ == "br") {
-    compressed_ = true;
-    encoding_ = "br";
-    set_ext(path.substr(0, path.find_last_of('.')));
-    relpath_ = relpath_.substr(0, relpath_.find_last_of('.'));
-  } else if (ext_ == "gzip" || ext_ == "gz") {
-    compressed_ = true;
-    encoding_ = "gzip";
+  if (auto encoding = encoding_from_ext(ext_)) {
+    encoding_ = *encoding;
     set_ext(path.substr(0, path.find_last_of('.')));
     relpath_ = relpath_.substr(0, relpath_.find_last_of('.'));
   }
@@ -115,8 +188,7 @@ void FileEntry::set_mime_type(const std::string_view &path) {
   if (itr != dict.end()) {
     mime_type_ = itr->second;
   }
+  compressible_ = is_compressible(mime_type_);
 }
 
-void FileEntry::remove_self() { worker_->remove_static_file(this); }
-
 } // namespace hm
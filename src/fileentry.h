@@ -1,55 +1,103 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
 
+#include <sys/stat.h>
+
+#include "compression.h"
 #include "datastream.h"
 
 namespace hm {
 
-class Worker;
-
+// Static file opened once and shared by all workers. Immutable, a file that
+// changes on disk gets a new entry (see StaticFiles).
 class FileEntry {
 
   friend class Server;
+  friend class FileCache;
+  friend class StaticFiles;
   struct FileInfo;
 
-  FileEntry(int fd, std::string path, Worker *worker, bool watch);
+  FileEntry(int fd, std::string path, size_t root_len);
+  FileEntry(int fd, std::shared_ptr<FileEntry> source,
+            ContentEncoding encoding);
+  // copy of |file| with the entity tag |etag|
+  FileEntry(int fd, const FileEntry &file, std::string etag);
 
 public:
-  static std::unique_ptr<FileEntry> create(std::string path, Worker *worker,
-                                           bool watch);
+  // larger files keep the entity tag made from their metadata
+  constexpr static size_t max_hashed_size = 32 << 20;
+  // hex digits of fingerprint()
+  constexpr static size_t fingerprint_size = 16;
+
+  // Opens |path|, relpath() is the path after the first |root_len| bytes.
+  static std::shared_ptr<FileEntry> create(std::string path, size_t root_len);
+  // |source| compressed with |encoding| into |fd|, which is taken over
+  static std::shared_ptr<FileEntry>
+  create_variant(int fd, std::shared_ptr<FileEntry> source,
+                 ContentEncoding encoding);
+  // |file| with an entity tag hashed from its contents, null if it can't be
+  // read. Reads the whole file, StaticFiles calls it in the background
+  static std::shared_ptr<FileEntry> create_hashed(const FileEntry &file);
   FileEntry(const FileEntry &) = delete;
   FileEntry &operator=(const FileEntry &) = delete;
 
   ~FileEntry();
 
-  int fd() { return fd_; }
+  int fd() const { return fd_; }
 
-  std::string_view path() { return path_; }
+  std::string_view path() const { return path_; }
   // relative path ignoring encoding suffix
-  std::string_view relpath() { return relpath_; }
-
-  std::string_view mime_type() { return mime_type_; }
-
-  const FileInfo &info();
-
-  std::string_view ext() { return ext_; }
-
-  bool compressed() { return compressed_; }
-
-  std::string_view encoding() { return encoding_; }
-
-  void remove_self();
+  std::string_view relpath() const { return relpath_; }
+
+  std::string_view mime_type() const { return mime_type_; }
+  // text and the like, see is_compressible()
+  bool compressible() const { return compressible_; }
+
+  const FileInfo &info() const { return info_; }
+
+  // response header values of this version of the file, computed once. The
+  // entity tag is strong: a digest of size, mtime and inode when opened,
+  // replaced by a hash of the contents (see create_hashed())
+  std::string_view etag() const { return etag_; }
+  std::string_view content_length() const { return content_length_; }
+  std::string_view last_modified() const { return last_modified_; }
+  // the entity tag is a hash of the contents
+  bool hashed() const { return hashed_; }
+  // part of the entity tag identifying the contents in asset URLs, if
+  // hashed()
+  std::string_view fingerprint() const {
+    return std::string_view(etag_).substr(1, fingerprint_size);
+  }
+  // fingerprint() from the metadata, identifies the version of the file
+  // whether it was hashed or not
+  std::string_view stat_fingerprint() const {
+    return std::string_view(stat_tag_).substr(0, fingerprint_size);
+  }
+
+  std::string_view ext() const { return ext_; }
+
+  bool compressed() const { return encoding_ != ContentEncoding::IDENTITY; }
+
+  ContentEncoding encoding() const { return encoding_; }
+
+  // file this variant was compressed from by the server, null if it was
+  // read from disk
+  const std::shared_ptr<FileEntry> &source() const { return source_; }
+
+  // whole contents, nullopt if the file got shorter since it was opened
+  std::optional<std::string> read() const;
 
 private:
   void check_if_compressed(const std::string_view &path);
   void set_ext(const std::string_view &path);
   void set_mime_type(const std::string_view &path);
-  void update_info(const FileInfo &info);
-
-  static void update_cb(struct ev_loop *loop, struct ev_stat *w, int revents);
+  // sets the header values, info_ must be set
+  void set_validators(const struct stat &st);
 
 private:
   int fd_;
@@ -57,18 +105,28 @@ private:
   std::string relpath_;
   std::string ext_;
   std::string mime_type_;
-  bool compressed_;
-  bool watch_;
-  const char *encoding_;
-
-  std::atomic<bool> updated_;
-
-  Worker *worker_;
-  struct ev_stat *stat_watcher_;
+  bool compressible_ = false;
+  ContentEncoding encoding_;
+  std::shared_ptr<FileEntry> source_;
 
   struct FileInfo {
     int64_t mtime;
     int64_t length;
-  } info_, new_info_;
+  } info_;
+
+  std::string etag_;
+  bool hashed_ = false;
+  // digest of size, mtime and inode
+  std::string stat_tag_;
+  std::string content_length_;
+  std::string last_modified_;
+
+  // contents while held by the FileCache, and its CLOCK reference bit
+  mutable std::atomic<std::shared_ptr<const std::string>> contents_;
+  mutable std::atomic<bool> referenced_ = false;
+  // being read for the FileCache, or in it
+  mutable std::atomic<bool> loading_ = false;
+  // encodings already requested from the compressor, a bit per encoding
+  mutable std::atomic<uint8_t> compress_requested_ = 0;
 };
 } // namespace hm
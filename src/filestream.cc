@@ -1,40 +1,156 @@
 #include "filestream.h"
+#include "httpsession.h"
 #include "stream.h"
+#include "worker.h"
+
+#include <sys/uio.h>
 
 namespace hm {
 
-FileStream::FileStream(FileEntry *file_entry)
-    : file_(file_entry), length_(file_entry->info().length) {
-  pos_ = 0;
-}
+FileStream::FileStream(std::shared_ptr<FileEntry> file_entry, Stream *stream)
+    : FileStream(file_entry, stream, 0, file_entry->info().length) {}
 
-int FileStream::send(Stream *stream, size_t wlen) {
+FileStream::FileStream(std::shared_ptr<FileEntry> file_entry, Stream *stream,
+                       size_t offset, size_t length)
+    : start_(offset), length_(length), serial_(stream->serial()),
+      buffers_(std::make_shared<Buffers>()), file_(std::move(file_entry)) {}
 
-  assert(0 <= wlen && wlen <= remaining().first);
-  auto wb = stream->get_buffer();
+std::pair<size_t, bool> FileStream::remaining() {
+  if (pos_ == length_) {
+    return {0, true};
+  }
+  read_ahead();
 
-  while (wlen) {
-    ssize_t nread;
-    while ((nread = pread(file_->fd(), wb->last(), wlen, pos_)) == -1 &&
-           errno == EINTR)
-      ;
+  auto &chunk = buffers_->chunks[front_];
+  switch (chunk.state) {
+  case Chunk::READY: {
+    auto left = chunk.len - chunk.pos;
+    return {left, pos_ + left == length_};
+  }
+  case Chunk::FAILED:
+    // see failed()
+    return {0, false};
+  default:
+    buffers_->deferred = true;
+    return {0, false};
+  }
+}
 
-    if (nread == -1) {
-      std::cerr << "Read from file: " << file_->path() << " failed."
-                << std::endl;
-      std::cerr << "Error: " << strerror(errno) << std::endl;
+bool FileStream::failed() {
+  return buffers_->chunks[front_].state == Chunk::FAILED;
+}
 
-      stream->stop_read_timeout();
-      stream->stop_write_timeout();
-      return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+void FileStream::read_ahead() {
+  // the front buffer is always the first to be refilled, reads stay in order
+  for (auto index : {front_, front_ ^ 1}) {
+    if (buffers_->chunks[index].state == Chunk::EMPTY &&
+        next_read_ < length_) {
+      read_chunk(index);
     }
+  }
+}
+
+void FileStream::read_chunk(size_t index) {
+  auto &chunk = buffers_->chunks[index];
+  if (!chunk.data) {
+    chunk.data = std::make_unique<char[]>(std::min(chunk_size, length_));
+  }
+  auto size = std::min(chunk_size, length_ - next_read_);
 
-    wlen -= nread;
-    wb->write(nread);
+  // without blocking first, most reads are of cached pages
+  iovec iov = {chunk.data.get(), size};
+  ssize_t nread;
+  while ((nread = preadv2(file_->fd(), &iov, 1, start_ + next_read_,
+                          RWF_NOWAIT)) == -1 &&
+         errno == EINTR)
+    ;
 
-    pos_ += nread;
+  if (nread > 0) {
+    chunk.state = Chunk::READY;
+    chunk.len = nread;
+    chunk.pos = 0;
+    next_read_ += nread;
+    return;
   }
+  if (nread == -1 && (errno == EAGAIN || errno == EOPNOTSUPP)) {
+    offload_read(index, start_ + next_read_, size);
+    next_read_ += size;
+    return;
+  }
+
+  std::cerr << "Read from file: " << file_->path() << " failed." << std::endl;
+  std::cerr << "Error: " << (nread == 0 ? "file truncated" : strerror(errno))
+            << std::endl;
+  chunk.state = Chunk::FAILED;
+}
+
+void FileStream::offload_read(size_t index, size_t offset, size_t size) {
+  auto worker = Worker::get_worker();
+  worker->get_stats().file_reads_offloaded.inc();
+  buffers_->chunks[index].state = Chunk::READING;
+
+  // only the data is written off the worker thread, the chunk's state is
+  // updated once the completion is posted back
+  worker->get_io_pool()->submit([worker, serial = serial_, index, offset,
+                                 size, buffers = buffers_, file = file_,
+                                 data = buffers_->chunks[index].data.get()] {
+    size_t len = 0;
+    int error = 0;
+    while (len < size) {
+      auto nread = pread(file->fd(), data + len, size - len, offset + len);
+      if (nread == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        error = errno;
+        break;
+      }
+      if (nread == 0) {
+        break;
+      }
+      len += nread;
+    }
 
+    worker->post([worker, serial, index, len, size, error,
+                  buffers = std::move(buffers), file = std::move(file)] {
+      auto &chunk = buffers->chunks[index];
+      if (len == size) {
+        chunk.state = Chunk::READY;
+        chunk.len = len;
+        chunk.pos = 0;
+      } else {
+        std::cerr << "Read from file: " << file->path() << " failed."
+                  << std::endl;
+        std::cerr << "Error: "
+                  << (error ? strerror(error) : "file truncated")
+                  << std::endl;
+        chunk.state = Chunk::FAILED;
+      }
+
+      if (buffers->deferred) {
+        buffers->deferred = false;
+        if (auto stream = worker->get_stream(serial)) {
+          nghttp2_session_resume_data(
+              stream->get_session()->get_nghttp2_session(), stream->id());
+          stream->get_session()->start_write();
+        }
+      }
+    });
+  });
+}
+
+int FileStream::send(Stream *stream, size_t wlen) {
+  auto &chunk = buffers_->chunks[front_];
+  assert(chunk.state == Chunk::READY && chunk.pos + wlen <= chunk.len);
+  stream->get_buffer()->write_full(chunk.data.get() + chunk.pos, wlen);
+  chunk.pos += wlen;
+  pos_ += wlen;
+
+  if (chunk.pos == chunk.len) {
+    // refilled by the next remaining(), the other buffer is next
+    chunk.state = Chunk::EMPTY;
+    front_ ^= 1;
+  }
   return 0;
 }
 
@@ -4,25 +4,64 @@
 #include "fileentry.h"
 
 #include <cstdint>
+#include <memory>
 
 namespace hm {
 
+// Sends a file read ahead into two buffers. Reads the page cache can answer
+// are made in place (RWF_NOWAIT), the others run on the worker's IoPool and
+// the stream is deferred until their data arrives, so a cold file never
+// blocks the worker's loop.
 class FileStream : public DataStream {
 
 public:
-  FileStream(FileEntry *file_entry);
+  constexpr static size_t chunk_size = 128 << 10;
+
+  FileStream(std::shared_ptr<FileEntry> file_entry, Stream *stream);
+  // sends the |length| bytes at |offset|
+  FileStream(std::shared_ptr<FileEntry> file_entry, Stream *stream,
+             size_t offset, size_t length);
 
   int send(Stream *stream, size_t length) override;
 
   size_t length() override { return length_; }
   size_t offset() override { return pos_; }
-  std::pair<size_t, bool> remaining() override {
-    return {length_ - pos_, true};
-  }
+  std::pair<size_t, bool> remaining() override;
+  bool failed() override;
 
 private:
+  struct Chunk {
+    enum { EMPTY, READING, READY, FAILED } state = EMPTY;
+    std::unique_ptr<char[]> data;
+    // bytes read, and those of them sent
+    size_t len = 0;
+    size_t pos = 0;
+  };
+
+  // shared with the reads in flight, which may complete after the stream is
+  // gone
+  struct Buffers {
+    Chunk chunks[2];
+    // the stream waits for a read to resume it
+    bool deferred = false;
+  };
+
+  // starts reading into the empty buffers
+  void read_ahead();
+  void read_chunk(size_t index);
+  void offload_read(size_t index, size_t offset, size_t size);
+
+  // of the part of the file sent
+  size_t start_;
   size_t length_;
-  size_t pos_;
-  FileEntry *file_;
+  size_t pos_ = 0;
+  // offset of the next read from start_
+  size_t next_read_ = 0;
+  // buffer holding the bytes at pos_
+  size_t front_ = 0;
+  uint64_t serial_;
+  std::shared_ptr<Buffers> buffers_;
+  // kept open while sending, even if replaced in StaticFiles
+  std::shared_ptr<FileEntry> file_;
 };
 } // namespace hm
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace hm::util {
+
+bool streq_l(const std::string_view &a, const std::string_view &b);
+
+enum class HttpHeader {
+  pAUTHORITY,
+  pHOST,
+  pMETHOD,
+  pPATH,
+  pPROTOCOL,
+  pSCHEME,
+  pSTATUS,
+  ACCEPT_ENCODING,
+  ACCEPT_LANGUAGE,
+  ALT_SVC,
+  CACHE_CONTROL,
+  CONNECTION,
+  CONTENT_LENGTH,
+  CONTENT_TYPE,
+  COOKIE,
+  DATE,
+  EARLY_DATA,
+  EXPECT,
+  FORWARDED,
+  HOST,
+  HTTP2_SETTINGS,
+  IF_MODIFIED_SINCE,
+  IF_NONE_MATCH,
+  IF_RANGE,
+  KEEP_ALIVE,
+  LINK,
+  LOCATION,
+  PROXY_CONNECTION,
+  RANGE,
+  SEC_WEBSOCKET_ACCEPT,
+  SEC_WEBSOCKET_KEY,
+  SERVER,
+  TE,
+  TRAILER,
+  TRANSFER_ENCODING,
+  UPGRADE,
+  USER_AGENT,
+  VIA,
+  X_FORWARDED_FOR,
+  X_FORWARDED_PROTO,
+  MAXIDX,
+  eNOTFOUND,
+};
+
+constexpr size_t num_known_headers = (size_t)HttpHeader::MAXIDX;
+
+// names of known headers, indexed by HttpHeader
+constexpr std::array<std::string_view, num_known_headers> header_names = {
+    ":authority",
+    ":host",
+    ":method",
+    ":path",
+    ":protocol",
+    ":scheme",
+    ":status",
+    "accept-encoding",
+    "accept-language",
+    "alt-svc",
+    "cache-control",
+    "connection",
+    "content-length",
+    "content-type",
+    "cookie",
+    "date",
+    "early-data",
+    "expect",
+    "forwarded",
+    "host",
+    "http2-settings",
+    "if-modified-since",
+    "if-none-match",
+    "if-range",
+    "keep-alive",
+    "link",
+    "location",
+    "proxy-connection",
+    "range",
+    "sec-websocket-accept",
+    "sec-websocket-key",
+    "server",
+    "te",
+    "trailer",
+    "transfer-encoding",
+    "upgrade",
+    "user-agent",
+    "via",
+    "x-forwarded-for",
+    "x-forwarded-proto",
+};
+
+namespace detail {
+
+constexpr size_t header_table_size = 256;
+
+// case insensitive FNV-1a
+constexpr uint32_t header_hash(std::string_view name, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  for (char c : name) {
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+  }
+  return h % header_table_size;
+}
+
+// first seed mapping every known header name to a distinct slot
+constexpr uint32_t find_header_seed() {
+  for (uint32_t seed = 0;; seed++) {
+    std::array<bool, header_table_size> used{};
+    bool ok = true;
+    for (auto name : header_names) {
+      auto h = header_hash(name, seed);
+      if (used[h]) {
+        ok = false;
+        break;
+      }
+      used[h] = true;
+    }
+    if (ok) {
+      return seed;
+    }
+  }
+}
+
+constexpr uint32_t header_seed = find_header_seed();
+
+constexpr uint8_t header_table_empty = 0xff;
+
+constexpr auto header_table = [] {
+  std::array<uint8_t, header_table_size> table{};
+  table.fill(header_table_empty);
+  for (size_t i = 0; i < header_names.size(); i++) {
+    table[header_hash(header_names[i], header_seed)] = (uint8_t)i;
+  }
+  return table;
+}();
+
+} // namespace detail
+
+// perfect hash lookup, case insensitive
+inline HttpHeader lookup_header(std::string_view name) {
+  auto i = detail::header_table[detail::header_hash(name, detail::header_seed)];
+  if (i != detail::header_table_empty &&
+      name.size() == header_names[i].size() && streq_l(name, header_names[i])) {
+    return (HttpHeader)i;
+  }
+  return HttpHeader::eNOTFOUND;
+}
+
+inline HttpHeader lookup_header(const uint8_t *name, size_t namelen) {
+  return lookup_header({reinterpret_cast<const char *>(name), namelen});
+}
+
+} // namespace hm::util
@@ -114,12 +114,51 @@ AwaitableTask<simdjson::ondemand::document> HttpRequest::json() {
   co_return parser->iterate(body_);
 }
 
-std::optional<std::string_view> HttpRequest::get_cookie(std::string_view key) {
-  auto cookies = get_header("cookie");
-  if (!cookies) {
-    return std::nullopt;
+void HttpRequest::start_handler(Task<> &&handler) {
+  stream_->coro_handler_ = std::move(handler);
+}
+
+const RouteParams::Param *
+HttpRequest::find_param(std::string_view label,
+                        std::optional<RouteNodeData::Type> type) const {
+  auto &labels = param_labels_;
+  for (size_t i = 0; i < labels.size() && i < params_.count; i++) {
+    if (labels[i].label == label) {
+      if (type && labels[i].type != *type) {
+        return nullptr;
+      }
+      return &params_.params[i];
+    }
+  }
+  return nullptr;
+}
+
+std::optional<std::string_view>
+HttpRequest::get_param(std::string_view label) const {
+  if (auto param = find_param(label)) {
+    return param->value;
   }
-  return util::get_cookie(cookies.value(), key);
+  return std::nullopt;
+}
+
+std::optional<int64_t>
+HttpRequest::get_int_param(std::string_view label) const {
+  if (auto param = find_param(label, RouteNodeData::Type::PARAM_INT)) {
+    return param->int_value;
+  }
+  return std::nullopt;
+}
+
+std::optional<double>
+HttpRequest::get_float_param(std::string_view label) const {
+  if (auto param = find_param(label, RouteNodeData::Type::PARAM_FLOAT)) {
+    return param->float_value;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::string_view> HttpRequest::get_cookie(std::string_view key) {
+  return stream_->headers.get_cookie(key);
 }
 
 }; // namespace hm
@@ -2,6 +2,7 @@
 
 #include <functional>
 #include <optional>
+#include <span>
 #include <string>
 
 #include "awaitabletask.h"
@@ -19,6 +20,8 @@ class HttpRequest {
   friend class Stream;
   friend class HttpSession;
   friend class HttpRouter;
+  template <class... Routes> friend class StaticRouter;
+  friend struct RouterBench;
 
   using coro_handle =
       std::coroutine_handle<AwaitableTask<std::string_view>::Promise>;
@@ -37,12 +40,23 @@ public:
 
   AwaitableTask<simdjson::ondemand::document> json();
 
-  constexpr std::optional<std::string_view>
-  get_param(std::string_view label) const;
+  // value of path parameter {label}, {label:int} or {label:float}
+  std::optional<std::string_view> get_param(std::string_view label) const;
+  // parsed value of {label:int} and {label:float} parameters
+  std::optional<int64_t> get_int_param(std::string_view label) const;
+  std::optional<double> get_float_param(std::string_view label) const;
 
   std::optional<std::string_view> get_cookie(std::string_view key);
 
 private:
+  // matched parameter labelled |label| of type |type|, any if nullopt
+  const RouteParams::Param *
+  find_param(std::string_view label,
+             std::optional<RouteNodeData::Type> type = std::nullopt) const;
+
+  // keeps the coroutine of the matched handler alive with the stream
+  void start_handler(Task<> &&handler);
+
   void add_to_body(std::string_view str);
   void handle_data(std::string_view str, bool eof = false);
   void handle_body();
@@ -50,8 +64,11 @@ private:
 private:
   HttpRequest(Stream *stream);
 
-  const HttpRouter *router_;
-  size_t handler_index_;
+  // labels of the matched route's parameters, in capture order
+  std::span<const RouteNodeData> param_labels_;
+  RouteParams params_;
+  // set by routes with their own compression policy
+  const CompressPolicy *compress_policy_ = nullptr;
 
   Stream *stream_;
 
@@ -67,19 +84,4 @@ private:
   bool buffered_;
 };
 
-constexpr std::optional<std::string_view>
-HttpRequest::get_param(std::string_view label) const {
-  auto route = std::string_view(router_->route_paths_[handler_index_]);
-  // goto bracket, match label, repeat
-  size_t pos, index = 0;
-  while ((pos = route.find('{')) != route.npos) {
-    if (route.substr(pos + 1, label.size()) == label) {
-      return router_->get_vars_vector()[index];
-    }
-    route = route.substr(pos + 1);
-    index++;
-  }
-  return std::nullopt;
-}
-
 } // namespace hm
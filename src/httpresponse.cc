@@ -37,6 +37,16 @@ void HttpResponse::send_json(db::ResultString &&str) {
   stream_->submit_json_response(std::move(str));
 }
 
+Arena *HttpResponse::get_arena() { return stream_->get_arena(); }
+
+std::string_view HttpResponse::copy(std::string_view str) {
+  return stream_->get_arena()->copy(str);
+}
+
+void HttpResponse::send_view(std::string_view str, const char *content_type) {
+  stream_->submit_view_response(str, content_type);
+}
+
 void HttpResponse::send_file(std::string_view path, bool relative, bool watch,
                              bool prefer_compressed) {
   stream_->submit_file_response(path, prefer_compressed, relative, watch);
@@ -1,6 +1,7 @@
 
 #pragma once
 
+#include "arena.h"
 #include "dbconnection.h"
 #include "dbresult.h"
 #include <functional>
@@ -29,6 +30,14 @@ public:
   void send_json(std::string &&str);
   void send_json(db::ResultString &&str);
 
+  // Request scoped memory, freed when the stream closes. Strings built here
+  // can be sent with send_view() without copying or separate allocation.
+  Arena *get_arena();
+  // null terminated copy of |str| in the arena
+  std::string_view copy(std::string_view str);
+  // |str| must outlive the response: arena or static memory
+  void send_view(std::string_view str, const char *content_type = nullptr);
+
   void send_file();
   void send_file(std::string_view path, bool relative = true, bool watch = true,
                  bool prefer_compressed = true);
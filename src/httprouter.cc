@@ -4,6 +4,10 @@
 #include "httpresponse.h"
 #include "stream.h"
 
+#include <bit>
+#include <charconv>
+#include <cstdlib>
+
 namespace hm {
 
 HttpMethod method_from_string(std::string_view str) {
@@ -33,26 +37,32 @@ std::string_view to_string(RouteNodeData::Type type) {
     return "ROOT";
   case CONSTANT:
     return "CONSTANT";
+  case WILDCARD:
+    return "WILDCARD";
   case PARAM_INT:
     return "PARAM_INT";
   case PARAM_FLOAT:
     return "PARAM_FLOAT";
   case PARAM_STRING:
     return "PARAM_STRING";
+  case PARAM_REGEX:
+    return "PARAM_REGEX";
+  case CATCH_ALL:
+    return "CATCH_ALL";
   }
   return "";
 }
 
-RouteNode::RouteNode() {
+RouteNode::RouteNode() : terminal(false), methods(0), terminal_methods(0) {
   data.type = RouteNodeData::Type::ROOT;
-  terminal = false;
 }
 
-RouteNode::RouteNode(const RouteNodeData &data) : data(data) {}
+RouteNode::RouteNode(const RouteNodeData &data)
+    : data(data), terminal(false), methods(0), terminal_methods(0) {}
 
 RouteNode::RouteNode(RouteNode &&b)
     : data(b.data), terminal(b.terminal), methods(b.methods),
-      children(std::move(b.children)) {
+      terminal_methods(b.terminal_methods), children(std::move(b.children)) {
   std::copy(b.route_index, b.route_index + 8, route_index);
 }
 
@@ -60,13 +70,15 @@ RouteNode &RouteNode::operator=(RouteNode &&b) {
   data = b.data;
   terminal = b.terminal;
   methods = b.methods;
+  terminal_methods = b.terminal_methods;
   children = std::move(b.children);
   std::copy(b.route_index, b.route_index + 8, route_index);
   return *this;
 }
 
 void RouteNode::insert_path(HttpMethod method, std::string_view path,
-                            size_t handler_index) {
+                            size_t handler_index,
+                            std::vector<RouteNodeData> &labels) {
   auto m = (uint32_t)method;
   methods |= (1 << m);
 
@@ -85,28 +97,19 @@ void RouteNode::insert_path(HttpMethod method, std::string_view path,
 
   RouteNodeData new_data;
   if (!level.empty()) {
-    if (level.front() == '{' && level.back() == '}') {
-      auto type_beg = level.find(':');
-      auto type_end = level.length() - 1;
-
-      if (type_beg == level.npos) {
-        new_data.label = level.substr(1, type_end - 1);
-      } else {
-        new_data.label = level.substr(1, type_beg - 1);
-      }
-      new_data.type = PARAM_STRING;
-
-      if (type_beg != level.npos) {
-        auto type = level.substr(type_beg + 1, type_end - type_beg - 1);
-        if (type == "int") {
-          new_data.type = PARAM_INT;
-        } else if (type == "float") {
-          new_data.type = PARAM_FLOAT;
-        }
-      }
-    } else {
-      new_data.label = level;
-      new_data.type = CONSTANT;
+    new_data = parse_route_segment(level);
+    if (new_data.type == PARAM_REGEX && !RegexDfa::compile(new_data.pattern)) {
+      // a route silently missing is worse than not starting
+      std::cerr << "Invalid route pattern: " << new_data.pattern
+                << " in segment: " << level << std::endl;
+      std::abort();
+    }
+    assert((new_data.type != CATCH_ALL || next_path == "/") &&
+           "Catch-all must be the last segment of a route");
+    if (is_route_param(new_data)) {
+      labels.push_back(new_data);
+      assert(labels.size() <= RouteParams::max_params &&
+             "Too many parameters in route");
     }
   }
 
@@ -119,153 +122,344 @@ void RouteNode::insert_path(HttpMethod method, std::string_view path,
       child.terminal = is_terminal;
 
       if (!is_terminal) {
-        child.insert_path(method, next_path, handler_index);
+        child.insert_path(method, next_path, handler_index, labels);
       } else {
         child.methods = 1 << m;
+        child.terminal_methods = 1 << m;
         child.route_index[m] = handler_index;
       }
     } else {
       auto &child = *itr;
       if (!is_terminal) {
-        child.insert_path(method, next_path, handler_index);
+        child.insert_path(method, next_path, handler_index, labels);
       } else {
         child.terminal = true;
         child.methods |= (1 << m);
+        child.terminal_methods |= (1 << m);
         child.route_index[m] = handler_index;
       }
     }
   } else if (data.type == ROOT) {
     // special case for "/", add handler to root itself
     terminal = true;
+    terminal_methods |= (1 << m);
     route_index[m] = handler_index;
   } else {
     assert(!level.empty() && "Route path level cannot be empty");
   }
 }
 
-/* returns handler index */
-std::size_t RouteNode::match(HttpMethod method, std::string_view path,
-                             std::vector<std::string_view> &vars) const {
+void RouteNode::insert_static_file(std::string_view path) {
+  methods |= static_file_bit;
+  if (path.size() <= 1) {
+    terminal = true;
+    terminal_methods |= static_file_bit;
+    return;
+  }
 
-  auto m = (uint32_t)method;
+  auto end = path.find('/', 1);
+  auto level = path.substr(1, end == path.npos ? path.npos : end - 1);
+  auto next_path = end == path.npos ? "/" : path.substr(end);
 
-  if ((methods & (1 << m)) == 0) {
-    return npos;
-  }
+  RouteNodeData new_data{.type = RouteNodeData::Type::CONSTANT, .label = level};
+  auto itr = std::find(children.begin(), children.end(), new_data);
+  auto &child = itr == children.end() ? children.emplace_back(new_data) : *itr;
+  child.insert_static_file(next_path);
+}
 
-  assert(path[0] == '/');
-  auto end = path.find_first_of('/', 1);
-  auto level = path.substr(1, end - 1);
+uint64_t CompiledRoutes::hash(std::string_view segment) {
+  // FNV-1a
+  uint64_t h = 14695981039346656037ull;
+  for (char c : segment) {
+    h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+  }
+  return h;
+}
 
-  auto next_path = end == path.npos ? "/" : path.substr(end);
+bool match_param(RouteNodeData::Type type, std::string_view segment,
+                 RouteParams::Param &param) {
+  using enum RouteNodeData::Type;
+  if (segment.empty()) {
+    return false;
+  }
+  param.value = segment;
+  auto first = segment.data(), last = segment.data() + segment.size();
+  switch (type) {
+  case PARAM_INT: { // digits only, and must fit
+    if (!std::all_of(first, last, [](char ch) { return std::isdigit(ch); })) {
+      return false;
+    }
+    auto [ptr, ec] = std::from_chars(first, last, param.int_value);
+    return ec == std::errc() && ptr == last;
+  }
+  case PARAM_FLOAT: { // requirements of number + atmost one dot
+    int n_dot = 0;
+    for (auto ch : segment) {
+      if (ch == '.') {
+        if (n_dot++) {
+          return false;
+        }
+      } else if (!std::isdigit(ch)) {
+        return false;
+      }
+    }
+    auto [ptr, ec] = std::from_chars(first, last, param.float_value);
+    return ec == std::errc() && ptr == last;
+  }
+  default: // anything passes
+    return true;
+  }
+}
 
-  // std::cout << "path: " << path << std::endl;
-  // std::cout << "next path: " << next_path << std::endl;
-  // std::cout << "label: " << data.label << std::endl;
-  // std::cout << "terminal: " << terminal << std::endl;
-  // std::cout << "type: " << (int)data.type << std::endl;
+void CompiledRoutes::compile(const RouteNode &root) {
+  nodes_.clear();
+  const_edges_.clear();
+  param_edges_.clear();
+  regexes_.clear();
+  add_node(root);
+}
 
+uint32_t CompiledRoutes::add_node(const RouteNode &node) {
   using enum RouteNodeData::Type;
 
-  switch (data.type) {
-  case ROOT: // matches everything
-    next_path = path;
-    break;
-  case CONSTANT: // only matches if level string matches
-    if (data.label == "*") {
-      break;
+  uint32_t index = nodes_.size();
+  auto &n = nodes_.emplace_back();
+  n.methods = node.methods;
+  n.terminal_methods = node.terminal ? node.terminal_methods : 0;
+  std::copy(node.route_index, node.route_index + 8, n.route_index);
+
+  // children are laid out after their parent, so edges are only known once
+  // the whole subtree is added
+  std::vector<std::pair<std::string_view, uint32_t>> constants;
+  std::vector<ParamEdge> params;
+  for (auto &child : node.children) {
+    auto child_index = add_node(child);
+    if (child.data.type == CONSTANT) {
+      constants.emplace_back(child.data.label, child_index);
+    } else if (child.data.type == PARAM_REGEX) {
+      auto regex = RegexDfa::compile(child.data.pattern);
+      // checked when the route was added
+      if (!regex) {
+        std::cerr << "Invalid route pattern: " << child.data.pattern
+                  << std::endl;
+        std::abort();
+      }
+      params.push_back(
+          {child.data.type, child_index, (uint32_t)regexes_.size()});
+      regexes_.push_back(std::move(*regex));
+    } else {
+      params.push_back({child.data.type, child_index});
     }
-    if (data.label != level) {
+  }
+  // catch-all routes only match if nothing more specific does
+  std::stable_partition(params.begin(), params.end(), [](auto &edge) {
+    return edge.type != CATCH_ALL;
+  });
+
+  // references into nodes_ are invalidated by add_node()
+  auto &self = nodes_[index];
+
+  self.const_begin = const_edges_.size();
+  self.const_size = 0;
+  if (!constants.empty()) {
+    // at most half full
+    self.const_size = std::bit_ceil(constants.size() * 2);
+    const_edges_.resize(const_edges_.size() + self.const_size,
+                        ConstEdge{.child = (uint32_t)npos});
+    for (auto [label, child] : constants) {
+      auto h = hash(label);
+      auto mask = self.const_size - 1;
+      auto slot = h & mask;
+      while (const_edges_[self.const_begin + slot].child != (uint32_t)npos) {
+        slot = (slot + 1) & mask;
+      }
+      const_edges_[self.const_begin + slot] = {h, label, child};
+    }
+  }
+
+  self.param_begin = param_edges_.size();
+  param_edges_.insert(param_edges_.end(), params.begin(), params.end());
+  self.param_end = param_edges_.size();
+
+  return index;
+}
+
+uint32_t CompiledRoutes::find_constant(const Node &node,
+                                       std::string_view segment) const {
+  if (node.const_size == 0) {
+    return npos;
+  }
+  auto h = hash(segment);
+  auto mask = node.const_size - 1;
+  for (auto slot = h & mask;; slot = (slot + 1) & mask) {
+    auto &edge = const_edges_[node.const_begin + slot];
+    if (edge.child == (uint32_t)npos) {
       return npos;
     }
-    break;
-  case PARAM_INT: // check if its really an int
-    for (auto &ch : level) {
-      if (!std::isdigit(ch)) {
-        return npos;
+    if (edge.hash == h && edge.label == segment) {
+      return edge.child;
+    }
+  }
+}
+
+size_t CompiledRoutes::match(HttpMethod method, std::string_view path,
+                             RouteParams &params) const {
+  auto method_bit = 1u << (uint32_t)method;
+  // subtrees worth descending into
+  auto m = method_bit;
+  if (method == HttpMethod::GET) {
+    m |= RouteNode::static_file_bit;
+  }
+
+  if (nodes_.empty() || (nodes_[0].methods & m) == 0 || path.empty() ||
+      path[0] != '/') {
+    return npos;
+  }
+  size_t found = npos;
+
+  // explicit stack of the nodes on the current path, a node is revisited to
+  // try its next parameter edge when a deeper match fails. Constant edges
+  // are tried first, then parameter edges in the order routes were added
+  struct Frame {
+    uint32_t node;
+    // offset of the rest of the path, starting with '/'
+    uint32_t pos;
+    uint32_t next_param;
+    uint32_t nvars;
+    bool visited;
+  };
+  Frame stack[max_depth];
+  size_t sp = 0;
+  auto &captured = params.params;
+  stack[0] = {.node = 0, .pos = 0, .next_param = 0, .nvars = 0};
+
+  for (;;) {
+    auto &f = stack[sp];
+    auto &node = nodes_[f.node];
+    auto rest = path.substr(f.pos);
+
+    if (rest.size() <= 1) {
+      // whole path consumed ("" or "/")
+      if (node.terminal_methods & method_bit) {
+        params.count = f.nvars;
+        return node.route_index[(uint32_t)method];
+      }
+      // only a constant path leads to a static file, a handler matched by
+      // backtracking still takes precedence
+      if (node.terminal_methods & RouteNode::static_file_bit) {
+        found = static_file;
+      }
+      if (sp-- == 0) {
+        return found;
       }
+      continue;
     }
-    vars.emplace_back(level);
-    break;
-  case PARAM_FLOAT: { // requirements of number + atmost one dot
-    int n_dot = 0;
-    for (auto &ch : level) {
-      if (!std::isdigit(ch) && ch != '.') {
-        return npos;
-      } else if (ch == '.') {
-        if (n_dot++) { // just one decimal point
-          return npos;
+
+    auto end = rest.find('/', 1);
+    auto segment = rest.substr(1, end == rest.npos ? rest.npos : end - 1);
+
+    uint32_t child = npos;
+    bool capture = false;
+    if (!f.visited) {
+      f.visited = true;
+      f.next_param = node.param_begin;
+      child = find_constant(node, segment);
+      if (child != (uint32_t)npos && (nodes_[child].methods & m) == 0) {
+        child = npos;
+      }
+    }
+    while (child == (uint32_t)npos && f.next_param < node.param_end) {
+      auto &edge = param_edges_[f.next_param++];
+      if ((nodes_[edge.child].methods & m) == 0) {
+        continue;
+      }
+      using enum RouteNodeData::Type;
+      if (edge.type == WILDCARD) {
+        child = edge.child;
+      } else if (f.nvars == RouteParams::max_params) {
+        continue;
+      } else if (edge.type == CATCH_ALL) {
+        segment = rest.substr(1);
+        captured[f.nvars].value = segment;
+        child = edge.child;
+        capture = true;
+      } else if (edge.type == PARAM_REGEX) {
+        if (!segment.empty() && regexes_[edge.regex].match(segment)) {
+          captured[f.nvars].value = segment;
+          child = edge.child;
+          capture = true;
         }
+      } else if (match_param(edge.type, segment, captured[f.nvars])) {
+        child = edge.child;
+        capture = true;
       }
     }
-    vars.emplace_back(level);
-  } break;
-  case PARAM_STRING:
-    // nothing to match here, anything passes
-    vars.emplace_back(level);
-    break;
-  }
 
-  // std::cerr << "======================================" << std::endl;
-  // std::cerr << "semi-matched:" << std::endl;
-  // std::cout << "path: " << path << std::endl;
-  // std::cout << "next path: " << next_path << std::endl;
-  // std::cout << "label: " << data.label << std::endl;
-  // std::cout << "terminal: " << terminal << std::endl;
-  // std::cout << "type: " << to_string(data.type) << std::endl;
-  // std::cerr << "======================================" << std::endl;
-
-  if (next_path != "/") {
-    for (auto &child : children) {
-      if (auto r = child.match(method, next_path, vars); r != npos) {
-        return r;
+    if (child == (uint32_t)npos || sp + 1 == max_depth) {
+      // dead end, backtrack
+      if (sp-- == 0) {
+        return found;
       }
+      continue;
     }
-  }
 
-  if (terminal) {
-    // std::cerr << "======================================" << std::endl;
-    // std::cerr << "matched:" << std::endl;
-    // std::cout << "path: " << path << std::endl;
-    // std::cout << "next path: " << next_path << std::endl;
-    // std::cout << "label: " << data.label << std::endl;
-    // std::cout << "terminal: " << terminal << std::endl;
-    // std::cout << "type: " << to_string(data.type) << std::endl;
-    // std::cerr << "======================================" << std::endl;
-    return route_index[m];
+    stack[++sp] = {.node = child,
+                   .pos = (uint32_t)(f.pos + 1 + segment.size()),
+                   .next_param = 0,
+                   .nvars = f.nvars + capture,
+                   .visited = false};
   }
+}
 
-  switch (data.type) {
-  case PARAM_FLOAT:
-  case PARAM_INT:
-  case PARAM_STRING:
-    vars.pop_back();
-    break;
-  default:
-    break;
+void HttpRouter::compile() {
+  compiled_.compile(root_);
+  compiled_ready_ = true;
+}
+
+void HttpRouter::add_static_file(std::string_view path) {
+  assert(!compiled_ready_ && "Routes must be added before the server starts");
+  assert(path[0] == '/');
+  auto itr = static_files_.emplace(path).first;
+  root_.insert_static_file(*itr);
+  if (path == "/index.html") {
+    root_.insert_static_file("/");
   }
+}
 
-  return npos;
+RouteMatch HttpRouter::dispatch_route(HttpMethod method, std::string_view path,
+                                      HttpRequest *request,
+                                      HttpResponse *response) const {
+  assert(compiled_ready_);
+  auto index = compiled_.match(method, path, request->params_);
+  if (index == CompiledRoutes::static_file) {
+    return RouteMatch::STATIC_FILE;
+  }
+  if (index != CompiledRoutes::npos) {
+    request->param_labels_ = route_labels_[index];
+    if (auto &policy = compress_policies_[index]) {
+      request->compress_policy_ = &*policy;
+    }
+    if (auto &cache = caches_[index];
+        cache && method == HttpMethod::GET &&
+        cache->lookup(request->stream_)) {
+      // served from the cache, or waiting for another request's response
+      return RouteMatch::HANDLER;
+    }
+    invoke_handler(index, request, response);
+    return RouteMatch::HANDLER;
+  }
+  return RouteMatch::NOT_FOUND;
 }
 
-bool HttpRouter::dispatch_route(HttpMethod method, std::string_view path,
-                                HttpRequest *request,
+void HttpRouter::invoke_handler(size_t index, HttpRequest *request,
                                 HttpResponse *response) const {
-  get_vars_vector().clear();
-  auto index = root_.match(method, path, get_vars_vector());
-  if (index != RouteNode::npos) {
-    request->router_ = this;
-    request->handler_index_ = index;
-    if (std::holds_alternative<coro_func>(handlers_[index])) {
-      auto &h = std::get<coro_func>(handlers_[index]);
-      request->stream_->coro_handler_ = std::invoke(h, request, response);
-    } else {
-      auto &h = std::get<func>(handlers_[index]);
-      std::invoke(h, request, response);
-    }
-    return true;
+  if (std::holds_alternative<coro_func>(handlers_[index])) {
+    auto &h = std::get<coro_func>(handlers_[index]);
+    request->start_handler(std::invoke(h, request, response));
+  } else {
+    auto &h = std::get<func>(handlers_[index]);
+    std::invoke(h, request, response);
   }
-  return false;
 }
 
 void RouteNode::debug_print() const {
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
 #include <string_view>
 #include <variant>
 #include <vector>
 
+#include "compression.h"
+#include "regexdfa.h"
+#include "responsecache.h"
 #include "task.h"
 #include "util.h"
 
@@ -20,23 +28,103 @@ enum class HttpMethod { GET, POST, PUT, HEAD, PATCH, DELETE, OPTIONS };
 HttpMethod method_from_string(std::string_view str);
 
 struct RouteNodeData {
-  enum class Type { ROOT, CONSTANT, PARAM_INT, PARAM_FLOAT, PARAM_STRING };
+  enum class Type {
+    ROOT,
+    CONSTANT,
+    WILDCARD,
+    PARAM_INT,
+    PARAM_FLOAT,
+    PARAM_STRING,
+    PARAM_REGEX,
+    // rest of the path, one or more segments
+    CATCH_ALL
+  };
 
   Type type;
   std::string_view label;
+  // expression of PARAM_REGEX
+  std::string_view pattern = {};
 };
 
 std::string_view to_string(RouteNodeData::Type type);
 
+// "{label}", "{label:int}", "{label:float}", "{label:string}",
+// "{label:<regex>}", "{label...}", "*", "**" or a constant
+constexpr RouteNodeData parse_route_segment(std::string_view level) {
+  using enum RouteNodeData::Type;
+  if (level.size() > 1 && level.front() == '{' && level.back() == '}') {
+    auto type_beg = level.find(':');
+    auto type_end = level.length() - 1;
+
+    RouteNodeData data{.type = PARAM_STRING};
+    if (type_beg == level.npos) {
+      data.label = level.substr(1, type_end - 1);
+      if (data.label.ends_with("...")) {
+        data.label.remove_suffix(3);
+        data.type = CATCH_ALL;
+      }
+    } else {
+      data.label = level.substr(1, type_beg - 1);
+      auto type = level.substr(type_beg + 1, type_end - type_beg - 1);
+      if (type == "int") {
+        data.type = PARAM_INT;
+      } else if (type == "float") {
+        data.type = PARAM_FLOAT;
+      } else if (type != "string") {
+        data.type = PARAM_REGEX;
+        data.pattern = type;
+      }
+    }
+    return data;
+  } else if (level == "*") {
+    return {.type = WILDCARD, .label = level};
+  } else if (level == "**") {
+    return {.type = CATCH_ALL, .label = {}};
+  }
+  return {.type = CONSTANT, .label = level};
+}
+
+// whether the segment is captured as a parameter
+constexpr bool is_route_param(const RouteNodeData &data) {
+  using enum RouteNodeData::Type;
+  return data.type != ROOT && data.type != CONSTANT && data.type != WILDCARD;
+}
+
+// path parameters captured by a route match, stored inline in the request
+struct RouteParams {
+  constexpr static size_t max_params = 16;
+
+  struct Param {
+    std::string_view value;
+    // parsed while matching {label:int} and {label:float} segments
+    union {
+      int64_t int_value;
+      double float_value;
+    };
+  };
+
+  std::array<Param, max_params> params;
+  size_t count = 0;
+};
+
+// checks |segment| has the type of the parameter, parsing it into |param|
+bool match_param(RouteNodeData::Type type, std::string_view segment,
+                 RouteParams::Param &param);
+
 struct RouteNode;
 
 struct RouteNode {
 
   constexpr static size_t npos = static_cast<size_t>(-1);
+  // bit in methods and terminal_methods marking static files, served for GET
+  // when no handler matches
+  constexpr static uint32_t static_file_bit = 1 << 8;
 
   RouteNodeData data;
   bool terminal;
+  // methods handled in this subtree, and at this node
   uint32_t methods;
+  uint32_t terminal_methods;
   uint16_t route_index[8]; // there shouldn't be more than 2^16 handlers
   std::vector<RouteNode> children;
 
@@ -48,54 +136,127 @@ struct RouteNode {
   RouteNode(const RouteNode &) = delete;
   RouteNode &operator=(const RouteNode &) = delete;
 
+  // appends parameters in |path| to |labels|
   void insert_path(HttpMethod method, std::string_view path,
-                   size_t handler_index);
-  /* returns handler index */
-  std::size_t match(HttpMethod method, std::string_view path,
-                    std::vector<std::string_view> &vars) const;
+                   size_t handler_index, std::vector<RouteNodeData> &labels);
+  // |path| is taken literally, all segments are constants
+  void insert_static_file(std::string_view path);
 
   void debug_print() const;
 };
 
+// Flat, read-only form of the route trie, built once all routes are added.
+// Nodes, constant edges and parameter edges live in contiguous arrays;
+// constant children of a node are found through a small open addressing hash
+// table instead of comparing every label.
+class CompiledRoutes {
+public:
+  constexpr static size_t npos = RouteNode::npos;
+  // match() result when only a static file matched
+  constexpr static size_t static_file = npos - 1;
+  // deepest path (in segments) and most parameters a route can match
+  constexpr static size_t max_depth = 32;
+
+  void compile(const RouteNode &root);
+
+  /* returns handler index, static_file or npos, captured parameters are
+   * stored in |params| */
+  size_t match(HttpMethod method, std::string_view path,
+               RouteParams &params) const;
+
+private:
+  struct Node {
+    // methods handled in this subtree, and at this node
+    uint32_t methods;
+    uint32_t terminal_methods;
+    uint16_t route_index[8];
+    // slice of const_edges_, a power of two sized hash table
+    uint32_t const_begin;
+    uint32_t const_size;
+    // slice of param_edges_, in priority order
+    uint32_t param_begin;
+    uint32_t param_end;
+  };
+
+  struct ConstEdge {
+    uint64_t hash;
+    std::string_view label;
+    uint32_t child; // npos if empty slot
+  };
+
+  struct ParamEdge {
+    RouteNodeData::Type type;
+    uint32_t child;
+    // index in regexes_ for PARAM_REGEX
+    uint32_t regex;
+  };
+
+  uint32_t add_node(const RouteNode &node);
+  uint32_t find_constant(const Node &node, std::string_view segment) const;
+
+  static uint64_t hash(std::string_view segment);
+
+  std::vector<Node> nodes_;
+  std::vector<ConstEdge> const_edges_;
+  std::vector<ParamEdge> param_edges_;
+  std::vector<RegexDfa> regexes_;
+};
+
+enum class RouteMatch { HANDLER, STATIC_FILE, NOT_FOUND };
+
 class HttpRouter {
   using func = std::function<void(HttpRequest *, HttpResponse *)>;
   using coro_func = std::function<Task<>(HttpRequest *, HttpResponse *)>;
 
   friend class HttpRequest;
+  friend class ResponseCache;
 
 public:
-  struct HandlerData {
-    HttpRouter *router;
-    size_t handler_index;
+  // responses of GET routes with a |cache| policy are cached, |compress|
+  // replaces the server's compression policy for the route
+  void add_route(HttpMethod method, const char *route_path,
+                 std::invocable<HttpRequest *, HttpResponse *> auto &&handler,
+                 const CachePolicy *cache = nullptr,
+                 const CompressPolicy *compress = nullptr);
 
-    constexpr std::optional<std::string_view>
-    get_param(std::string_view label) const;
-  };
+  // builds the lookup table, must be called after the last add_route() and
+  // before the first dispatch_route()
+  void compile();
 
-private:
-  auto &get_vars_vector() const {
-    thread_local std::vector<std::string_view> vars;
-    return vars;
-  }
+  // Serves |path| (relative to the static root, starting with '/') with
+  // Stream::submit_file_response() when no handler matches a GET request.
+  void add_static_file(std::string_view path);
 
-public:
-  void add_route(HttpMethod method, const char *route_path,
-                 std::invocable<HttpRequest *, HttpResponse *> auto &&handler);
-
-  bool dispatch_route(HttpMethod method, std::string_view path,
-                      HttpRequest *request, HttpResponse *response) const;
+  // calls the handler if one matches, otherwise classifies the request
+  RouteMatch dispatch_route(HttpMethod method, std::string_view path,
+                            HttpRequest *request,
+                            HttpResponse *response) const;
 
 private:
+  void invoke_handler(size_t index, HttpRequest *request,
+                      HttpResponse *response) const;
+
   void debug_print() const;
 
   RouteNode root_;
+  CompiledRoutes compiled_;
+  bool compiled_ready_ = false;
   std::vector<std::variant<func, coro_func>> handlers_;
   std::vector<const char *> route_paths_;
+  // parameters of every route, in capture order
+  std::vector<std::vector<RouteNodeData>> route_labels_;
+  // nullptr for routes without a cache
+  std::vector<std::unique_ptr<ResponseCache>> caches_;
+  // nullopt for routes using the server's policy
+  std::vector<std::optional<CompressPolicy>> compress_policies_;
+  // owns the labels of static file nodes
+  std::set<std::string, std::less<>> static_files_;
 };
 
 constexpr bool operator==(const RouteNodeData &a, const RouteNodeData &b) {
   return a.type == b.type &&
-         (a.type == RouteNodeData::Type::ROOT || a.label == b.label);
+         (a.type == RouteNodeData::Type::ROOT ||
+          (a.label == b.label && a.pattern == b.pattern));
 }
 
 constexpr bool operator==(const RouteNode &a, const RouteNodeData &b) {
@@ -113,8 +274,10 @@ concept CoroFunc = requires(T a, HttpRequest *rq, HttpResponse *rs) {
 
 void HttpRouter::add_route(
     HttpMethod method, const char *route_path,
-    std::invocable<HttpRequest *, HttpResponse *> auto &&handler) {
+    std::invocable<HttpRequest *, HttpResponse *> auto &&handler,
+    const CachePolicy *cache, const CompressPolicy *compress) {
   assert(handlers_.size() == route_paths_.size());
+  assert(!compiled_ready_ && "Routes must be added before the server starts");
   size_t handler_index = handlers_.size();
   if constexpr (CoroFunc<decltype(handler)>) {
     handlers_.emplace_back(std::in_place_type<coro_func>, std::move(handler));
@@ -122,7 +285,15 @@ void HttpRouter::add_route(
     handlers_.emplace_back(std::in_place_type<func>, std::move(handler));
   }
   route_paths_.emplace_back(std::move(route_path));
-  root_.insert_path(method, route_path, handler_index);
+  route_labels_.emplace_back();
+  caches_.push_back(method == HttpMethod::GET && cache
+                        ? std::make_unique<ResponseCache>(*cache, this,
+                                                          handler_index)
+                        : nullptr);
+  compress_policies_.push_back(compress ? std::optional(*compress)
+                                        : std::nullopt);
+  root_.insert_path(method, route_path, handler_index,
+                    route_labels_.back());
 }
 
 } // namespace hm
@@ -3,6 +3,7 @@
 #include <libpq-fe.h>
 #include <nghttp2/nghttp2.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <cstring>
 #include <iostream>
@@ -48,9 +49,16 @@ HttpSession::~HttpSession() {
   ev_timer_stop(loop_, &settings_timerev_);
   ev_io_stop(loop_, &rev_);
   ev_io_stop(loop_, &wev_);
+  // streams still hold rcbufs of the nghttp2 session
+  for (auto stream : streams_) {
+    worker_->destroy_stream(stream);
+  }
   if (session_) {
     nghttp2_session_del(session_);
   }
+  if (wbuf_) {
+    worker_->wbuf_pool_.release(wbuf_);
+  }
   SSL_shutdown(ssl_.get());
   shutdown(client_fd_, SHUT_WR);
   close(client_fd_);
@@ -115,19 +123,35 @@ int HttpSession::ssl_read(uint8_t *buf, size_t buflen) {
   return rv;
 }
 
+void HttpSession::queue_buffered() {
+  oq_.push(wmark_, wbuf_->last() - wmark_);
+  wmark_ = wbuf_->last();
+}
+
+void HttpSession::queue_ref(const void *data, size_t len) {
+  // keep order with what was written to wbuf_ before
+  queue_buffered();
+  oq_.push(data, len);
+}
+
 int HttpSession::fill_wb() {
   for (;;) {
     if (data_pending_) {
-      auto n = wbuf_.write(data_pending_, data_pending_len_);
+      auto n = wbuf_->write(data_pending_, data_pending_len_);
       if (n < data_pending_len_) {
         data_pending_len_ -= n;
         data_pending_ += n;
-        return 0;
+        break;
       }
       data_pending_ = nullptr;
       data_pending_len_ = 0;
     }
 
+    if (oq_.space() < 4) {
+      // send_data_cb may need up to 3 ranges, and 1 for the buffer tail
+      break;
+    }
+
     const uint8_t *data;
     auto datalen = nghttp2_session_mem_send(session_, &data);
 
@@ -145,9 +169,59 @@ int HttpSession::fill_wb() {
     data_pending_len_ = datalen;
   }
 
+  queue_buffered();
   return 0;
 }
 
+int HttpSession::flush_output() {
+  if (!ktls_send_) {
+    // Every SSL_write() is at least one record, so frame headers and small
+    // bodies are gathered into full records first, large ranges are
+    // encrypted in place. The front of the queue only grows until drained,
+    // so a retried write sends the same bytes, with at least the same length.
+    constexpr auto record_size = Worker::tls_record_size;
+    auto &iov = oq_.front();
+    const uint8_t *data;
+    size_t len;
+    if (iov.iov_len >= record_size) {
+      data = static_cast<const uint8_t *>(iov.iov_base);
+      // the rest goes with what follows
+      len = iov.iov_len - iov.iov_len % record_size;
+    } else {
+      auto buf = worker_->tls_record_.data();
+      len = 0;
+      for (size_t i = 0; i < oq_.iovcnt() && len < record_size; i++) {
+        auto n = std::min(oq_.iov()[i].iov_len, record_size - len);
+        std::memcpy(buf + len, oq_.iov()[i].iov_base, n);
+        len += n;
+      }
+      data = buf;
+    }
+    auto rv = ssl_write(data, len);
+    if (rv > 0) {
+      oq_.drain(rv);
+    }
+    return rv;
+  }
+
+  ssize_t nwrite;
+  while ((nwrite = writev(client_fd_, oq_.iov(), oq_.iovcnt())) == -1 &&
+         errno == EINTR)
+    ;
+
+  if (nwrite == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      ev_io_start(loop_, &wev_);
+      return 0;
+    }
+    std::cerr << "writev() failed: " << strerror(errno) << std::endl;
+    return -1;
+  }
+
+  oq_.drain(nwrite);
+  return nwrite;
+}
+
 void HttpSession::read_cb(struct ev_loop *loop, ev_io *w, int revents) {
   auto self = static_cast<HttpSession *>(w->data);
 
@@ -229,28 +303,59 @@ void HttpSession::fill_callback(nghttp2_session_callbacks *callbacks) {
       callbacks, HttpSession::on_data_chunk_recv_cb);
   nghttp2_session_callbacks_set_on_header_callback2(callbacks,
                                                     HttpSession::on_header_cb);
+  nghttp2_session_callbacks_set_on_begin_frame_callback(
+      callbacks, HttpSession::on_begin_frame_cb);
   nghttp2_session_callbacks_set_on_begin_headers_callback(
       callbacks, HttpSession::on_begin_headers_cb);
   nghttp2_session_callbacks_set_send_data_callback(callbacks,
                                                    HttpSession::send_data_cb);
+  nghttp2_session_callbacks_set_data_source_read_length_callback(
+      callbacks, HttpSession::data_read_length_cb);
   /* no padding */
 }
 
 int HttpSession::connection_made() {
 
-  int r = nghttp2_session_server_new(&session_, worker_->callbacks_, this);
+  int r = nghttp2_session_server_new3(&session_, worker_->callbacks_, this,
+                                      worker_->options_, &worker_->h2_mem_);
+
+  if (r != 0) {
+    return r;
+  }
+
+  auto &conf = get_server()->config_.http2;
+
+  auto max_frame_size =
+      std::clamp<uint32_t>(conf.max_frame_size, NGHTTP2_MAX_FRAME_SIZE_MIN,
+                           NGHTTP2_MAX_FRAME_SIZE_MAX);
+  wtuner_.stream_window =
+      std::clamp<int32_t>(conf.initial_window_size, 0, NGHTTP2_MAX_WINDOW_SIZE);
+  wtuner_.connection_window =
+      std::clamp<int32_t>(conf.connection_window_size,
+                          NGHTTP2_INITIAL_CONNECTION_WINDOW_SIZE,
+                          NGHTTP2_MAX_WINDOW_SIZE);
 
+  nghttp2_settings_entry entries[] = {
+      {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, conf.max_concurrent_streams},
+      {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, (uint32_t)wtuner_.stream_window},
+      {NGHTTP2_SETTINGS_MAX_FRAME_SIZE, max_frame_size}};
+
+  r = nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, entries,
+                              std::size(entries));
   if (r != 0) {
     return r;
   }
 
-  /* some config */
-  nghttp2_settings_entry entries[1];
-  size_t len = 1;
-  entries[0].settings_id = NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
-  entries[0].value = 100; /* max concurrent streams */
+  auto now = ev_now(loop_);
+  limits_.stream.init(conf.stream_limit, now);
+  limits_.rst_stream.init(conf.rst_stream_limit, now);
+  limits_.settings.init(conf.settings_limit, now);
+  limits_.ping.init(conf.ping_limit, now);
+  limits_.empty_frame.init(conf.empty_frame_limit, now);
 
-  r = nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, entries, len);
+  // connection window is not part of SETTINGS, it's raised by WINDOW_UPDATE
+  r = nghttp2_session_set_local_window_size(session_, NGHTTP2_FLAG_NONE, 0,
+                                            wtuner_.connection_window);
   if (r != 0) {
     return r;
   }
@@ -263,6 +368,86 @@ int HttpSession::connection_made() {
   return on_write();
 }
 
+void HttpSession::calm_down() {
+  if (calmed_) {
+    return;
+  }
+  calmed_ = true;
+  worker_->stats_.h2_sessions_calmed.inc();
+  nghttp2_session_terminate_session(session_, NGHTTP2_ENHANCE_YOUR_CALM);
+}
+
+// opaque data of PING frames sent for window autotuning
+static constexpr std::string_view bdp_ping_data = "hmbdpest";
+
+void HttpSession::on_data_received(size_t len) {
+  auto &conf = get_server()->config_.http2;
+  if (!conf.window_autotune) {
+    return;
+  }
+
+  wtuner_.sample += len;
+
+  if (wtuner_.ping_in_flight) {
+    return;
+  }
+
+  if (wtuner_.stream_window >= conf.max_window_size &&
+      wtuner_.connection_window >= conf.max_window_size) {
+    // nothing left to tune
+    return;
+  }
+
+  if (nghttp2_submit_ping(session_, NGHTTP2_FLAG_NONE,
+                          (const uint8_t *)bdp_ping_data.data()) != 0) {
+    return;
+  }
+
+  wtuner_.ping_in_flight = true;
+  wtuner_.ping_sent_at = ev_time();
+  wtuner_.sample = len;
+}
+
+void HttpSession::on_ping_ack(const uint8_t *opaque_data) {
+  if (!wtuner_.ping_in_flight ||
+      std::string_view((const char *)opaque_data, 8) != bdp_ping_data) {
+    return;
+  }
+
+  wtuner_.ping_in_flight = false;
+  wtuner_.rtt = ev_time() - wtuner_.ping_sent_at;
+
+  auto &conf = get_server()->config_.http2;
+  auto bdp = (int64_t)wtuner_.sample;
+  wtuner_.sample = 0;
+
+  // window is grown when the link kept more than 2/3 of it busy for one RTT
+  auto grow = [&](int32_t window) -> int32_t {
+    if (bdp * 3 < (int64_t)window * 2 || window >= conf.max_window_size) {
+      return window;
+    }
+    return (int32_t)std::min<int64_t>(std::max<int64_t>(bdp, window) * 2,
+                                      conf.max_window_size);
+  };
+
+  if (auto window = grow(wtuner_.connection_window);
+      window != wtuner_.connection_window) {
+    if (nghttp2_session_set_local_window_size(session_, NGHTTP2_FLAG_NONE, 0,
+                                              window) == 0) {
+      wtuner_.connection_window = window;
+    }
+  }
+
+  if (auto window = grow(wtuner_.stream_window);
+      window != wtuner_.stream_window) {
+    nghttp2_settings_entry entry = {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE,
+                                    (uint32_t)window};
+    if (nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, &entry, 1) == 0) {
+      wtuner_.stream_window = window;
+    }
+  }
+}
+
 int HttpSession::tls_handshake() {
 
   ev_io_stop(worker_->loop_, &wev_);
@@ -294,6 +479,8 @@ int HttpSession::tls_handshake() {
     return -1;
   }
 
+  ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_.get()));
+
   read_func_ = &HttpSession::read;
   write_func_ = &HttpSession::write;
 
@@ -310,41 +497,63 @@ int HttpSession::read() {
 
   ERR_clear_error();
 
+  // nghttp2 consumes everything it's given, buffer is only needed here
+  auto rbuf = worker_->rbuf_pool_.acquire();
+
+  int rv;
   for (;;) {
-    auto rv = ssl_read(rbuf_.data(), rbuf_.size());
+    rv = ssl_read(rbuf->data(), rbuf->size());
 
     if (rv <= 0) {
-      return rv;
+      break;
     }
 
     auto nread = rv;
-    rv = nghttp2_session_mem_recv(session_, rbuf_.data(), nread);
+    rv = nghttp2_session_mem_recv(session_, rbuf->data(), nread);
 
     if (rv < 0) {
       std::cerr << "nghttp2_session_mem_recv() returned error: "
                 << nghttp2_strerror(rv) << std::endl;
-      return -1;
+      rv = -1;
+      break;
+    }
+
+    if (calmed_) {
+      // don't process anything else from this client, send GOAWAY and close
+      ev_io_stop(loop_, &rev_);
+      rv = on_write();
+      break;
     }
   }
-  return 0;
+
+  worker_->rbuf_pool_.release(rbuf);
+  return rv;
 }
 
 int HttpSession::write() {
   ERR_clear_error();
 
   for (;;) {
-    if (wbuf_.rleft() > 0) {
-      auto rv = ssl_write(wbuf_.pos(), wbuf_.rleft());
+    if (!oq_.empty()) {
+      auto rv = flush_output();
       if (rv <= 0) {
         return rv;
       }
-      wbuf_.drain(rv);
     } else {
-      wbuf_.reset();
+      // everything written, bodies kept alive for the queue can go
+      oq_.reset();
+      if (!wbuf_) {
+        wbuf_ = worker_->wbuf_pool_.acquire();
+      }
+      wbuf_->reset();
+      wmark_ = wbuf_->last();
       if (fill_wb() != 0) {
         return -1;
       }
-      if (wbuf_.rleft() == 0) {
+      if (oq_.empty()) {
+        // idle, give the buffer back
+        worker_->wbuf_pool_.release(wbuf_);
+        wbuf_ = nullptr;
         ev_io_stop(loop_, &wev_);
         break;
       }
@@ -352,7 +561,7 @@ int HttpSession::write() {
   }
 
   if (nghttp2_session_want_read(session_) == 0 &&
-      nghttp2_session_want_write(session_) == 0 && wbuf_.rleft() == 0) {
+      nghttp2_session_want_write(session_) == 0 && oq_.empty()) {
     return -1;
   }
 
@@ -360,15 +569,24 @@ int HttpSession::write() {
 }
 
 Stream *HttpSession::get_stream(int32_t id) {
-  auto itr = streams_.find(id);
-  if (itr == streams_.end()) {
+  if (!session_) {
     return nullptr;
-  } else {
-    return &(itr->second);
   }
+  return static_cast<Stream *>(
+      nghttp2_session_get_stream_user_data(session_, id));
 }
 
-void HttpSession::remove_stream(int32_t id) { streams_.erase(id); }
+void HttpSession::remove_stream(int32_t id) {
+  auto stream = get_stream(id);
+  if (!stream) {
+    return;
+  }
+  nghttp2_session_set_stream_user_data(session_, id, nullptr);
+  auto itr = std::find(streams_.begin(), streams_.end(), stream);
+  *itr = streams_.back();
+  streams_.pop_back();
+  worker_->destroy_stream(stream);
+}
 
 nghttp2_session *HttpSession::get_nghttp2_session() { return session_; }
 
@@ -393,6 +611,13 @@ ssize_t HttpSession::data_read_cb(nghttp2_session *session, int32_t stream_id,
   // std::cout << "left: " << left << std::endl
   //           << "should_close: " << should_close << std::endl;
 
+  if (ds->failed()) {
+    // a truncated body must not look complete, nghttp2 resets the stream
+    stream->stop_read_timeout();
+    stream->stop_write_timeout();
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+
   if (left <= 0 && !should_close) {
     return NGHTTP2_ERR_DEFERRED;
   }
@@ -421,6 +646,27 @@ ssize_t HttpSession::data_read_cb(nghttp2_session *session, int32_t stream_id,
   return nread;
 }
 
+ssize_t HttpSession::data_read_length_cb(
+    nghttp2_session *session, uint8_t frame_type, int32_t stream_id,
+    int32_t session_remote_window_size, int32_t stream_remote_window_size,
+    uint32_t remote_max_frame_size, void *user_data) {
+  auto self = static_cast<HttpSession *>(user_data);
+  auto stream = self->get_stream(stream_id);
+
+  size_t limit = NGHTTP2_MAX_FRAME_SIZE_MIN;
+  if (stream &&
+      (std::holds_alternative<FileStream>(stream->data_stream_store_) ||
+       std::holds_alternative<ByteRangesStream>(stream->data_stream_store_))) {
+    // frame header and payload must fit in the write buffer at once
+    limit = std::min(self->get_server()->config_.http2.max_file_frame_size,
+                     WriteBuffer::capacity() - 9);
+  }
+
+  return std::min<ssize_t>({(ssize_t)limit, session_remote_window_size,
+                            stream_remote_window_size,
+                            (ssize_t)remote_max_frame_size});
+}
+
 int HttpSession::on_header_cb(nghttp2_session *session,
                               const nghttp2_frame *frame, nghttp2_rcbuf *name,
                               nghttp2_rcbuf *value, uint8_t flags,
@@ -448,10 +694,10 @@ int HttpSession::on_header_cb(nghttp2_session *session,
     return 0;
   }
 
-  auto header_type = util::lookup_header(namebuf.base, namebuf.len);
+  auto header = util::lookup_header(namebuf.base, namebuf.len);
 
   stream->headers.buffer_size += (namebuf.len + valuebuf.len);
-  stream->headers.add_header(name, value);
+  stream->headers.add_header(header, name, value);
 
   // std::cout << std::string_view{(char *)namebuf.base, namebuf.len} << ":"
   //           << std::string_view{(char *)valuebuf.base, valuebuf.len}
@@ -460,6 +706,58 @@ int HttpSession::on_header_cb(nghttp2_session *session,
   return 0;
 }
 
+int HttpSession::on_begin_frame_cb(nghttp2_session *session,
+                                   const nghttp2_frame_hd *hd,
+                                   void *user_data) {
+  auto self = static_cast<HttpSession *>(user_data);
+
+  if (self->calmed_) {
+    return 0;
+  }
+
+  auto now = ev_now(self->loop_);
+  auto &limits = self->limits_;
+  auto &stats = self->worker_->stats_;
+
+  switch (hd->type) {
+  case NGHTTP2_RST_STREAM:
+    if (!limits.rst_stream.consume(now)) {
+      stats.h2_rst_stream_flood.inc();
+      self->calm_down();
+    }
+    break;
+  case NGHTTP2_SETTINGS:
+    if (!(hd->flags & NGHTTP2_FLAG_ACK) && !limits.settings.consume(now)) {
+      stats.h2_settings_flood.inc();
+      self->calm_down();
+    }
+    break;
+  case NGHTTP2_PING:
+    if (!(hd->flags & NGHTTP2_FLAG_ACK) && !limits.ping.consume(now)) {
+      stats.h2_ping_flood.inc();
+      self->calm_down();
+    }
+    break;
+  case NGHTTP2_DATA:
+    if (hd->length == 0 && !(hd->flags & NGHTTP2_FLAG_END_STREAM) &&
+        !limits.empty_frame.consume(now)) {
+      stats.h2_empty_frame_flood.inc();
+      self->calm_down();
+    }
+    break;
+  case NGHTTP2_HEADERS:
+  case NGHTTP2_CONTINUATION:
+    if (hd->length == 0 && !(hd->flags & NGHTTP2_FLAG_END_HEADERS) &&
+        !limits.empty_frame.consume(now)) {
+      stats.h2_empty_frame_flood.inc();
+      self->calm_down();
+    }
+    break;
+  }
+
+  return 0;
+}
+
 int HttpSession::on_begin_headers_cb(nghttp2_session *session,
                                      const nghttp2_frame *frame,
                                      void *user_data) {
@@ -470,17 +768,28 @@ int HttpSession::on_begin_headers_cb(nghttp2_session *session,
       frame->headers.cat != NGHTTP2_HCAT_REQUEST) {
     return 0;
   }
-  // add new stream
-  auto [itr, inserted] = self->streams_.try_emplace(
-      frame->hd.stream_id,
-      /* arguments to stream ctor */ self, frame->hd.stream_id);
 
-  if (!inserted) {
+  if (self->calmed_) {
+    // session is going away, don't bother constructing the stream
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+
+  if (!self->limits_.stream.consume(ev_now(self->loop_))) {
+    self->worker_->stats_.h2_stream_flood.inc();
+    self->calm_down();
+    return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+  }
+  if (self->get_stream(frame->hd.stream_id)) {
     // stream with same id exists
     return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
   }
 
-  itr->second.reset_read_timeout();
+  // add new stream
+  auto stream = self->worker_->create_stream(self, frame->hd.stream_id);
+  self->streams_.push_back(stream);
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+
+  stream->reset_read_timeout();
 
   return 0;
 }
@@ -554,6 +863,13 @@ int HttpSession::on_frame_recv_cb(nghttp2_session *session,
     if (frame->hd.flags & NGHTTP2_FLAG_ACK) {
       self->remove_settings_timer();
     }
+    break;
+  }
+  case NGHTTP2_PING: {
+    if (frame->hd.flags & NGHTTP2_FLAG_ACK) {
+      self->on_ping_ack(frame->ping.opaque_data);
+    }
+    break;
   }
   default:
     break;
@@ -624,11 +940,12 @@ int HttpSession::send_data_cb(nghttp2_session *session, nghttp2_frame *frame,
                               nghttp2_data_source *source, void *user_data) {
   auto http_session = static_cast<HttpSession *>(user_data);
   auto stream = http_session->get_stream(frame->hd.stream_id);
-  auto &wb = http_session->wbuf_;
+  auto &wb = *http_session->wbuf_;
   auto padlen = frame->data.padlen;
   auto self = static_cast<DataStream *>(source->ptr);
 
-  if (wb.wleft() < 9 + length + padlen) {
+  if (wb.wleft() < 9 + self->buffer_usage(stream, length) + padlen ||
+      http_session->oq_.space() < 4) {
     return NGHTTP2_ERR_WOULDBLOCK;
   }
 
@@ -664,6 +981,8 @@ int HttpSession::on_data_chunk_recv_cb(nghttp2_session *session, uint8_t flags,
   auto self = static_cast<HttpSession *>(user_data);
   auto stream = self->get_stream(stream_id);
 
+  self->on_data_received(len);
+
   if (!stream) {
     return 0;
   }
@@ -1,15 +1,17 @@
 #pragma once
 
 #include <cstdint>
-#include <list>
 #include <memory>
-#include <unordered_map>
+#include <vector>
 
 #include <ev.h>
 #include <nghttp2/nghttp2.h>
 #include <openssl/ssl.h>
 
 #include "buffer.h"
+#include "bufferpool.h"
+#include "outputqueue.h"
+#include "ratelimit.h"
 #include "server.h"
 #include "stream.h"
 #include "util.h"
@@ -53,6 +55,19 @@ public:
   void start_read() { ev_io_start(loop_, &rev_); }
   void start_write() { ev_io_start(loop_, &wev_); }
 
+  // round trip time measured with the last PING, 0 if not measured yet
+  double rtt() { return wtuner_.rtt; }
+
+  // true if |length| bytes of a body are better queued by reference than
+  // copied into the write buffer
+  bool should_reference(size_t length) {
+    return length >= (ktls_send_ ? 1024 : 8 * 1024);
+  }
+  // queues |len| bytes at |data| without copying, caller keeps them alive
+  // until written (see OutputQueue::keep_alive)
+  void queue_ref(const void *data, size_t len);
+  OutputQueue *get_output_queue() { return &oq_; }
+
 private:
   static void settings_timeout_cb(struct ev_loop *loop, ev_timer *t,
                                   int revents);
@@ -63,17 +78,34 @@ private:
                               uint8_t *buf, size_t length, uint32_t *data_flags,
                               nghttp2_data_source *source, void *user_data);
 
+  static ssize_t data_read_length_cb(nghttp2_session *session,
+                                     uint8_t frame_type, int32_t stream_id,
+                                     int32_t session_remote_window_size,
+                                     int32_t stream_remote_window_size,
+                                     uint32_t remote_max_frame_size,
+                                     void *user_data);
+
   inline int ssl_write(const uint8_t *data, size_t datalen);
   inline int ssl_read(uint8_t *data, size_t datalen);
 
   inline int verify_npn();
   inline int connection_made();
 
+  // terminates session with ENHANCE_YOUR_CALM
+  void calm_down();
+
+  // window autotuning
+  void on_data_received(size_t len);
+  void on_ping_ack(const uint8_t *opaque_data);
+
   int tls_handshake();
   int read();
   int write();
 
   inline int fill_wb();
+  // queues bytes written to wbuf_ since last call
+  inline void queue_buffered();
+  inline int flush_output();
 
   inline int on_write() { return (this->*(this->write_func_))(); }
   inline int on_read() { return (this->*(this->read_func_))(); }
@@ -82,6 +114,9 @@ private:
                           nghttp2_rcbuf *name, nghttp2_rcbuf *value,
                           uint8_t flags, void *user_data);
 
+  static int on_begin_frame_cb(nghttp2_session *session,
+                               const nghttp2_frame_hd *hd, void *user_data);
+
   static int on_begin_headers_cb(nghttp2_session *session,
                                  const nghttp2_frame *frame, void *user_data);
 
@@ -107,8 +142,6 @@ private:
                                 uint32_t error_code, void *user_data);
 
 private:
-  std::list<HttpSession>::iterator itr_;
-
   Worker *worker_;
   struct ev_loop *loop_;
   int client_fd_;
@@ -117,10 +150,16 @@ private:
   ev_io wev_;
   ev_io rev_;
 
-  Buffer<64 * 1024> wbuf_;
-  std::array<uint8_t, 16 * 1024> rbuf_;
+  // borrowed from the worker only while there is something to write
+  WriteBuffer *wbuf_ = nullptr;
+
+  // start of bytes in wbuf_ not queued yet
+  uint8_t *wmark_ = nullptr;
+  OutputQueue oq_;
 
   SSLSession ssl_;
+  // kernel TLS encrypts for us, output queue can be written with writev
+  bool ktls_send_ = false;
 
   nghttp2_session *session_;
 
@@ -130,6 +169,30 @@ private:
   const uint8_t *data_pending_ = nullptr;
   size_t data_pending_len_ = 0;
 
-  std::unordered_map<int32_t, Stream> streams_;
+  // bandwidth-delay product estimation, a PING is sent when DATA arrives and
+  // the bytes received until its ACK approximate what the link holds per RTT
+  struct WindowTuner {
+    bool ping_in_flight = false;
+    double ping_sent_at = 0.;
+    double rtt = 0.;
+    size_t sample = 0;
+    int32_t stream_window;
+    int32_t connection_window;
+  } wtuner_;
+
+  // rate accounting of frames received from the client
+  struct FrameLimits {
+    TokenBucket stream;
+    TokenBucket rst_stream;
+    TokenBucket settings;
+    TokenBucket ping;
+    TokenBucket empty_frame;
+  } limits_;
+
+  // set once the session is being terminated for abuse
+  bool calmed_ = false;
+
+  // open streams, looked up by id through nghttp2 stream user data
+  std::vector<Stream *> streams_;
 };
 } // namespace hm
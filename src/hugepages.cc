@@ -0,0 +1,73 @@
+#include "hugepages.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+#include <sys/mman.h>
+
+namespace hm {
+
+std::optional<HugePageMode> huge_page_mode_from_string(std::string_view str) {
+  if (str == "off") {
+    return HugePageMode::OFF;
+  } else if (str == "madvise") {
+    return HugePageMode::MADVISE;
+  } else if (str == "hugetlb") {
+    return HugePageMode::HUGETLB;
+  }
+  return std::nullopt;
+}
+
+// anonymous mapping aligned to huge_page_size, advised to use huge pages
+static void *map_transparent(size_t size) {
+  // over-allocate to be able to align, then cut off both ends
+  auto len = size + huge_page_size;
+  auto p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  auto addr = reinterpret_cast<uintptr_t>(p);
+  auto aligned = (addr + huge_page_size - 1) & ~(huge_page_size - 1);
+  if (aligned > addr) {
+    munmap(p, aligned - addr);
+  }
+  if (auto tail = addr + len - (aligned + size); tail > 0) {
+    munmap(reinterpret_cast<void *>(aligned + size), tail);
+  }
+  p = reinterpret_cast<void *>(aligned);
+#ifdef MADV_HUGEPAGE
+  // not fatal, THP may be disabled system wide
+  madvise(p, size, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+void *map_huge_pages(size_t size, HugePageMode mode) {
+  assert(size % huge_page_size == 0);
+  assert(mode != HugePageMode::OFF);
+
+#ifdef MAP_HUGETLB
+  if (mode == HugePageMode::HUGETLB) {
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      return p;
+    }
+    static std::atomic<bool> warned = false;
+    if (!warned.exchange(true)) {
+      std::cerr << "MAP_HUGETLB failed: " << strerror(errno)
+                << ", falling back to transparent huge pages" << std::endl;
+    }
+  }
+#endif
+
+  return map_transparent(size);
+}
+
+void unmap_huge_pages(void *p, size_t size) { munmap(p, size); }
+
+} // namespace hm
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+namespace hm {
+
+enum class HugePageMode {
+  // regular heap allocations
+  OFF,
+  // anonymous mappings with madvise(MADV_HUGEPAGE), transparent huge pages
+  MADVISE,
+  // MAP_HUGETLB from the reserved pool, falls back to MADVISE if exhausted
+  HUGETLB
+};
+
+std::optional<HugePageMode> huge_page_mode_from_string(std::string_view str);
+
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+// Maps |size| bytes (a multiple of huge_page_size) aligned to huge_page_size,
+// backed by huge pages as requested by |mode| (not OFF). Returns nullptr on
+// failure.
+void *map_huge_pages(size_t size, HugePageMode mode);
+void unmap_huge_pages(void *p, size_t size);
+
+} // namespace hm
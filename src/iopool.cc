@@ -0,0 +1,54 @@
+#include "iopool.h"
+
+#include <algorithm>
+
+namespace hm {
+
+IoPool::IoPool(size_t num_threads)
+    : num_threads_(std::max<size_t>(num_threads, 1)) {}
+
+IoPool::~IoPool() { stop(); }
+
+void IoPool::submit(std::function<void()> &&job) {
+  {
+    std::lock_guard lock(mutex_);
+    if (stop_) {
+      return;
+    }
+    queue_.push_back(std::move(job));
+    if (threads_.size() < num_threads_) {
+      threads_.emplace_back([this] { run(); });
+    }
+  }
+  cv_.notify_one();
+}
+
+void IoPool::stop() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+    queue_.clear();
+  }
+  cv_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+  threads_.clear();
+}
+
+void IoPool::run() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (stop_) {
+      return;
+    }
+    auto job = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+    job();
+    lock.lock();
+  }
+}
+
+} // namespace hm
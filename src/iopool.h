@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hm {
+
+// Threads running blocking file reads for a worker, so a cold page cache
+// stalls the read and not the worker's loop. Threads are started on the
+// first submit(), most workers never need them.
+class IoPool {
+public:
+  IoPool(size_t num_threads);
+  ~IoPool();
+  IoPool(const IoPool &) = delete;
+  IoPool &operator=(const IoPool &) = delete;
+
+  // runs |job| on one of the threads
+  void submit(std::function<void()> &&job);
+  // joins the threads, dropping queued jobs
+  void stop();
+
+private:
+  void run();
+
+  size_t num_threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> queue_;
+  bool stop_ = false;
+  std::vector<std::thread> threads_;
+};
+
+} // namespace hm
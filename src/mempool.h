@@ -0,0 +1,226 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "stats.h"
+
+namespace hm {
+
+// Single threaded allocator with power of two size classes, for small
+// objects that are allocated and freed at a high rate by one worker (nghttp2
+// streams, frames, HPACK entries). Blocks are carved from large chunks and
+// recycled through per class free lists, chunks left without live blocks are
+// returned by trim(). Requests larger than the biggest class go to malloc.
+class SizeClassPool {
+  // every block is preceded by a header recording its class, so free() and
+  // realloc() need no size
+  struct alignas(std::max_align_t) Header {
+    uint32_t size_class;
+  };
+
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  struct Chunk {
+    std::unique_ptr<std::byte[]> data;
+    // bytes carved so far
+    size_t used = 0;
+  };
+
+  constexpr static size_t min_shift = 4;
+  constexpr static size_t max_shift = 12;
+  constexpr static size_t num_classes = max_shift - min_shift + 1;
+  constexpr static uint32_t large_class = num_classes;
+  constexpr static size_t chunk_size = 64 * 1024;
+
+public:
+  // |allocs| counts allocations served, |large_allocs| those that bypassed
+  // the size classes
+  SizeClassPool(Counter &allocs, Counter &large_allocs)
+      : allocs_(allocs), large_allocs_(large_allocs) {
+    free_.fill(nullptr);
+  }
+  SizeClassPool(const SizeClassPool &) = delete;
+  SizeClassPool &operator=(const SizeClassPool &) = delete;
+
+  void *malloc(size_t size) {
+    auto cls = class_of(size);
+    Header *hdr;
+    if (cls == large_class) {
+      hdr = static_cast<Header *>(std::malloc(sizeof(Header) + size));
+      if (!hdr) {
+        return nullptr;
+      }
+      large_allocs_.inc();
+    } else if (free_[cls]) {
+      hdr = reinterpret_cast<Header *>(free_[cls]);
+      free_[cls] = free_[cls]->next;
+    } else {
+      hdr = carve(cls);
+    }
+    hdr->size_class = cls;
+    allocs_.inc();
+    return hdr + 1;
+  }
+
+  void free(void *ptr) {
+    if (!ptr) {
+      return;
+    }
+    auto hdr = static_cast<Header *>(ptr) - 1;
+    auto cls = hdr->size_class;
+    if (cls == large_class) {
+      std::free(hdr);
+      return;
+    }
+    auto block = reinterpret_cast<FreeBlock *>(hdr);
+    block->next = free_[cls];
+    free_[cls] = block;
+  }
+
+  void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > SIZE_MAX / size) {
+      return nullptr;
+    }
+    auto p = malloc(nmemb * size);
+    if (p) {
+      std::memset(p, 0, nmemb * size);
+    }
+    return p;
+  }
+
+  void *realloc(void *ptr, size_t size) {
+    if (!ptr) {
+      return malloc(size);
+    }
+    auto hdr = static_cast<Header *>(ptr) - 1;
+    if (hdr->size_class == large_class) {
+      if (class_of(size) == large_class) {
+        hdr = static_cast<Header *>(std::realloc(hdr, sizeof(Header) + size));
+        return hdr ? hdr + 1 : nullptr;
+      }
+    } else if (size <= block_size(hdr->size_class)) {
+      return ptr;
+    }
+    auto p = malloc(size);
+    if (!p) {
+      return nullptr;
+    }
+    // a large block shrinking into a class is at least as big as the class
+    auto old_size = hdr->size_class == large_class
+                        ? size
+                        : block_size(hdr->size_class);
+    std::memcpy(p, ptr, std::min(old_size, size));
+    free(ptr);
+    return p;
+  }
+
+  // releases every chunk whose carved blocks are all on the free lists, so a
+  // burst of streams doesn't pin its memory for the life of the worker. The
+  // chunk still being carved from is kept.
+  void trim() {
+    if (chunks_.size() < 2) {
+      return;
+    }
+    auto n = chunks_.size() - 1;
+    // chunk bases in address order, to map a free block to its chunk
+    std::vector<std::pair<std::byte *, size_t>> bases;
+    bases.reserve(n);
+    for (size_t i = 0; i < n; i++) {
+      bases.emplace_back(chunks_[i].data.get(), i);
+    }
+    std::sort(bases.begin(), bases.end());
+    auto chunk_of = [&](FreeBlock *block) -> size_t {
+      auto p = reinterpret_cast<std::byte *>(block);
+      auto it = std::upper_bound(bases.begin(), bases.end(),
+                                 std::make_pair(p, SIZE_MAX));
+      if (it == bases.begin() || p >= (--it)->first + chunk_size) {
+        return n; // in the current chunk
+      }
+      return it->second;
+    };
+
+    std::vector<size_t> free_bytes(n + 1);
+    for (uint32_t cls = 0; cls < num_classes; cls++) {
+      for (auto block = free_[cls]; block; block = block->next) {
+        free_bytes[chunk_of(block)] += sizeof(Header) + block_size(cls);
+      }
+    }
+    std::vector<bool> empty(n + 1);
+    bool any = false;
+    for (size_t i = 0; i < n; i++) {
+      empty[i] = free_bytes[i] == chunks_[i].used;
+      any |= empty[i];
+    }
+    if (!any) {
+      return;
+    }
+
+    // unlink the blocks of the empty chunks before freeing them
+    for (uint32_t cls = 0; cls < num_classes; cls++) {
+      auto link = &free_[cls];
+      while (*link) {
+        if (empty[chunk_of(*link)]) {
+          *link = (*link)->next;
+        } else {
+          link = &(*link)->next;
+        }
+      }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i <= n; i++) {
+      if (!empty[i]) {
+        chunks_[kept++] = std::move(chunks_[i]);
+      }
+    }
+    chunks_.resize(kept);
+  }
+
+private:
+  constexpr static size_t block_size(uint32_t cls) {
+    return size_t(1) << (cls + min_shift);
+  }
+
+  static uint32_t class_of(size_t size) {
+    if (size > block_size(num_classes - 1)) {
+      return large_class;
+    }
+    auto shift = std::bit_width(std::max<size_t>(size, 1) - 1);
+    return std::max<size_t>(shift, min_shift) - min_shift;
+  }
+
+  Header *carve(uint32_t cls) {
+    auto stride = sizeof(Header) + block_size(cls);
+    if (chunk_left_ < stride) {
+      chunks_.push_back({std::make_unique<std::byte[]>(chunk_size)});
+      chunk_pos_ = chunks_.back().data.get();
+      chunk_left_ = chunk_size;
+    }
+    auto hdr = reinterpret_cast<Header *>(chunk_pos_);
+    chunk_pos_ += stride;
+    chunk_left_ -= stride;
+    chunks_.back().used += stride;
+    return hdr;
+  }
+
+private:
+  std::array<FreeBlock *, num_classes> free_;
+  // the last chunk is the one being carved from
+  std::vector<Chunk> chunks_;
+  std::byte *chunk_pos_ = nullptr;
+  size_t chunk_left_ = 0;
+
+  Counter &allocs_;
+  Counter &large_allocs_;
+};
+
+} // namespace hm
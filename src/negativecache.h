@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+
+namespace hm {
+
+// Recent misses of a worker's file lookups, so requests for files that
+// don't exist don't probe the disk again. Direct mapped on the path hash.
+// An entry holds until the StaticFiles generation it was recorded at
+// changes, or it expires for paths no watcher covers.
+class NegativeCache {
+public:
+  constexpr static size_t size = 1024;
+
+  bool contains(std::string_view path, uint64_t generation,
+                double now) const {
+    auto hash = std::hash<std::string_view>{}(path);
+    auto &entry = entries_[hash % size];
+    return entry.hash == hash && entry.generation == generation &&
+           now < entry.expires;
+  }
+
+  void insert(std::string_view path, uint64_t generation, double expires) {
+    auto hash = std::hash<std::string_view>{}(path);
+    entries_[hash % size] = {hash, generation, expires};
+  }
+
+private:
+  struct Entry {
+    uint64_t hash = 0;
+    uint64_t generation = 0;
+    double expires = 0.;
+  };
+
+  std::array<Entry, size> entries_{};
+};
+
+} // namespace hm
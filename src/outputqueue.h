@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "dbresult.h"
+
+namespace hm {
+
+// Byte ranges waiting to be written to the connection, in order. Ranges
+// either point into the session write buffer or to response bodies owned by
+// streams, so bodies are written without being copied into the write buffer.
+class OutputQueue {
+public:
+  // memory that must outlive the queued ranges pointing into it
+  using Storage = std::variant<std::string, db::ResultString,
+                               std::shared_ptr<const std::string>>;
+
+  constexpr static size_t max_iovcnt = 64;
+
+  OutputQueue() : pos_(0), len_(0) {}
+  OutputQueue(const OutputQueue &) = delete;
+  OutputQueue &operator=(const OutputQueue &) = delete;
+
+  // Appends |len| bytes at |data|, merging with the last range if adjacent.
+  void push(const void *data, size_t len) {
+    if (len == 0) {
+      return;
+    }
+    auto p = static_cast<uint8_t *>(const_cast<void *>(data));
+    if (len_ > pos_) {
+      auto &last = iov_[len_ - 1];
+      if (static_cast<uint8_t *>(last.iov_base) + last.iov_len == p) {
+        last.iov_len += len;
+        return;
+      }
+    }
+    assert(len_ < max_iovcnt);
+    iov_[len_++] = {.iov_base = p, .iov_len = len};
+  }
+
+  // Number of ranges that can still be pushed.
+  size_t space() const { return max_iovcnt - len_; }
+
+  bool empty() const { return pos_ == len_; }
+
+  const iovec *iov() const { return iov_.data() + pos_; }
+  size_t iovcnt() const { return len_ - pos_; }
+
+  const iovec &front() const {
+    assert(!empty());
+    return iov_[pos_];
+  }
+
+  // Drops |count| written bytes from the front of the queue.
+  void drain(size_t count) {
+    while (count && pos_ < len_) {
+      auto &iov = iov_[pos_];
+      if (count < iov.iov_len) {
+        iov.iov_base = static_cast<uint8_t *>(iov.iov_base) + count;
+        iov.iov_len -= count;
+        return;
+      }
+      count -= iov.iov_len;
+      pos_++;
+    }
+  }
+
+  // Keeps |storage| alive until everything queued so far is written.
+  void keep_alive(Storage &&storage) {
+    keep_alive_.emplace_back(std::move(storage));
+  }
+
+  // Must only be called once everything is written.
+  void reset() {
+    assert(empty());
+    pos_ = len_ = 0;
+    keep_alive_.clear();
+  }
+
+private:
+  std::array<iovec, max_iovcnt> iov_;
+  size_t pos_, len_;
+
+  std::vector<Storage> keep_alive_;
+};
+
+} // namespace hm
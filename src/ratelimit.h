@@ -0,0 +1,42 @@
+#pragma once
+
+#include <algorithm>
+
+namespace hm {
+
+struct RateLimit {
+  // tokens refilled per second
+  double rate;
+  // maximum tokens that can be accumulated
+  double burst;
+};
+
+// fixed size token bucket, never allocates
+class TokenBucket {
+public:
+  TokenBucket() : tokens_(0.), last_(0.), limit_{0., 0.} {}
+
+  void init(const RateLimit &limit, double now) {
+    limit_ = limit;
+    tokens_ = limit.burst;
+    last_ = now;
+  }
+
+  // takes one token, returns false if the bucket is empty
+  bool consume(double now) {
+    tokens_ = std::min(limit_.burst, tokens_ + (now - last_) * limit_.rate);
+    last_ = now;
+    if (tokens_ < 1.) {
+      return false;
+    }
+    tokens_ -= 1.;
+    return true;
+  }
+
+private:
+  double tokens_;
+  double last_;
+  RateLimit limit_;
+};
+
+} // namespace hm
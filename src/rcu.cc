@@ -0,0 +1,54 @@
+#include "rcu.h"
+
+#include <algorithm>
+
+namespace hm {
+
+Rcu::~Rcu() {
+  for (auto &[epoch, deleter] : retired_) {
+    deleter();
+  }
+}
+
+void Rcu::add_reader(Reader *reader) {
+  std::lock_guard lock(mutex_);
+  readers_.push_back(reader);
+}
+
+void Rcu::remove_reader(Reader *reader) {
+  std::lock_guard lock(mutex_);
+  std::erase(readers_, reader);
+  collect_locked();
+}
+
+void Rcu::retire(std::function<void()> &&deleter) {
+  std::lock_guard lock(mutex_);
+  // readers that come online from now on can't see the unlinked data
+  auto epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+  retired_.emplace_back(epoch, std::move(deleter));
+  collect_locked();
+}
+
+void Rcu::collect() {
+  std::lock_guard lock(mutex_);
+  collect_locked();
+}
+
+void Rcu::collect_locked() {
+  if (retired_.empty()) {
+    return;
+  }
+  auto oldest = offline_epoch;
+  for (auto reader : readers_) {
+    oldest = std::min(oldest, reader->epoch_.load(std::memory_order_seq_cst));
+  }
+  std::erase_if(retired_, [&](auto &retired) {
+    if (retired.first > oldest) {
+      return false;
+    }
+    retired.second();
+    return true;
+  });
+}
+
+} // namespace hm
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+namespace hm {
+
+// Quiescent state based reclamation for data shared between workers.
+//
+// Workers read shared pointers without locks or reference counts. Writers
+// swap in a new version and retire the old one, which is freed once every
+// worker has been quiescent since: blocked in its event loop, or started a
+// new loop iteration. A reader must not keep a pointer across iterations.
+class Rcu {
+public:
+  class Reader {
+    friend class Rcu;
+    // epoch observed when the current loop iteration started
+    std::atomic<uint64_t> epoch_ = offline_epoch;
+  };
+
+  Rcu() = default;
+  Rcu(const Rcu &) = delete;
+  Rcu &operator=(const Rcu &) = delete;
+  // frees everything retired
+  ~Rcu();
+
+  void add_reader(Reader *reader);
+  void remove_reader(Reader *reader);
+
+  // start and end of a read side critical section, called by the reader's
+  // thread when it wakes up and before it blocks
+  void online(Reader *reader) {
+    reader->epoch_.store(epoch_.load(std::memory_order_seq_cst),
+                         std::memory_order_seq_cst);
+    // shared pointers must not be loaded before the epoch is published
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+  void offline(Reader *reader) {
+    reader->epoch_.store(offline_epoch, std::memory_order_release);
+  }
+
+  // Calls |deleter| once no reader can hold what was unlinked before this
+  // call. Thread safe.
+  void retire(std::function<void()> &&deleter);
+  // runs deleters that are due
+  void collect();
+
+private:
+  constexpr static uint64_t offline_epoch =
+      std::numeric_limits<uint64_t>::max();
+
+  void collect_locked();
+
+  std::atomic<uint64_t> epoch_ = 1;
+
+  std::mutex mutex_;
+  std::vector<Reader *> readers_;
+  std::vector<std::pair<uint64_t, std::function<void()>>> retired_;
+};
+
+} // namespace hm
@@ -0,0 +1,307 @@
+#include "regexdfa.h"
+
+#include <bitset>
+#include <cctype>
+#include <unordered_map>
+
+namespace hm {
+
+namespace {
+
+using CharSet = std::bitset<256>;
+using PositionSet = std::bitset<RegexDfa::max_positions>;
+
+// Builds the automaton directly from the expression (followpos
+// construction), every character of the expression is a position
+class Parser {
+public:
+  struct Expr {
+    bool nullable;
+    PositionSet first, last;
+  };
+
+  Parser(std::string_view pattern) : pattern_(pattern) {}
+
+  std::optional<Expr> parse() {
+    auto expr = parse_alternation();
+    if (!expr || pos_ != pattern_.size()) {
+      return std::nullopt;
+    }
+    return expr;
+  }
+
+  // adds a position accepting the characters of |chars|
+  std::optional<Expr> position(const CharSet &chars) {
+    if (chars_.size() == RegexDfa::max_positions) {
+      return std::nullopt;
+    }
+    Expr expr{.nullable = false};
+    expr.first.set(chars_.size());
+    expr.last.set(chars_.size());
+    chars_.push_back(chars);
+    follow_.emplace_back();
+    return expr;
+  }
+
+  Expr concat(const Expr &a, const Expr &b) {
+    add_follow(a.last, b.first);
+    return {.nullable = a.nullable && b.nullable,
+            .first = a.nullable ? a.first | b.first : a.first,
+            .last = b.nullable ? a.last | b.last : b.last};
+  }
+
+  const std::vector<CharSet> &chars() const { return chars_; }
+  const std::vector<PositionSet> &follow() const { return follow_; }
+
+private:
+  void add_follow(const PositionSet &from, const PositionSet &to) {
+    for (size_t i = 0; i < chars_.size(); i++) {
+      if (from[i]) {
+        follow_[i] |= to;
+      }
+    }
+  }
+
+  bool done() const { return pos_ == pattern_.size(); }
+  char peek() const { return pattern_[pos_]; }
+
+  std::optional<Expr> parse_alternation() {
+    auto expr = parse_concatenation();
+    while (expr && !done() && peek() == '|') {
+      pos_++;
+      auto b = parse_concatenation();
+      if (!b) {
+        return std::nullopt;
+      }
+      expr->nullable |= b->nullable;
+      expr->first |= b->first;
+      expr->last |= b->last;
+    }
+    return expr;
+  }
+
+  std::optional<Expr> parse_concatenation() {
+    Expr expr{.nullable = true};
+    while (!done() && peek() != '|' && peek() != ')') {
+      auto b = parse_repetition();
+      if (!b) {
+        return std::nullopt;
+      }
+      expr = concat(expr, *b);
+    }
+    return expr;
+  }
+
+  std::optional<Expr> parse_repetition() {
+    auto expr = parse_atom();
+    while (expr && !done()) {
+      auto ch = peek();
+      if (ch == '*' || ch == '+') {
+        add_follow(expr->last, expr->first);
+        expr->nullable |= ch == '*';
+      } else if (ch == '?') {
+        expr->nullable = true;
+      } else {
+        break;
+      }
+      pos_++;
+    }
+    return expr;
+  }
+
+  std::optional<Expr> parse_atom() {
+    auto ch = pattern_[pos_++];
+    switch (ch) {
+    case '(': {
+      auto expr = parse_alternation();
+      if (!expr || done() || peek() != ')') {
+        return std::nullopt;
+      }
+      pos_++;
+      return expr;
+    }
+    case '[': {
+      auto chars = parse_class();
+      if (!chars) {
+        return std::nullopt;
+      }
+      return position(*chars);
+    }
+    case '.':
+      return position(CharSet().set());
+    case '\\': {
+      auto chars = parse_escape();
+      if (!chars) {
+        return std::nullopt;
+      }
+      return position(*chars);
+    }
+    case '*':
+    case '+':
+    case '?':
+    case ')':
+    case ']':
+    case '{':
+    case '}':
+    case '^':
+    case '$':
+      return std::nullopt;
+    default:
+      return position(CharSet().set(static_cast<uint8_t>(ch)));
+    }
+  }
+
+  // after '\'
+  std::optional<CharSet> parse_escape() {
+    if (done()) {
+      return std::nullopt;
+    }
+    // <cctype> functions take unsigned char values
+    auto ch = static_cast<unsigned char>(pattern_[pos_++]);
+    CharSet chars;
+    auto add_if = [&](auto pred) {
+      for (int c = 0; c < 256; c++) {
+        if (pred(c)) {
+          chars.set(c);
+        }
+      }
+    };
+    switch (ch) {
+    case 'd':
+    case 'D':
+      add_if([](int c) { return std::isdigit(c); });
+      break;
+    case 'w':
+    case 'W':
+      add_if([](int c) { return std::isalnum(c) || c == '_'; });
+      break;
+    case 's':
+    case 'S':
+      add_if([](int c) { return std::isspace(c); });
+      break;
+    default:
+      if (std::isalnum(ch)) {
+        // unknown escape sequence
+        return std::nullopt;
+      }
+      chars.set(ch);
+      return chars;
+    }
+    if (std::isupper(ch)) {
+      chars.flip();
+    }
+    return chars;
+  }
+
+  // after '['
+  std::optional<CharSet> parse_class() {
+    CharSet chars;
+    bool negate = !done() && peek() == '^';
+    if (negate) {
+      pos_++;
+    }
+    bool first = true;
+    while (!done() && (first || peek() != ']')) {
+      first = false;
+      if (peek() == '\\') {
+        pos_++;
+        auto escaped = parse_escape();
+        if (!escaped) {
+          return std::nullopt;
+        }
+        chars |= *escaped;
+        continue;
+      }
+      auto lo = static_cast<uint8_t>(pattern_[pos_++]);
+      auto hi = lo;
+      if (pos_ + 1 < pattern_.size() && peek() == '-' &&
+          pattern_[pos_ + 1] != ']') {
+        hi = static_cast<uint8_t>(pattern_[pos_ + 1]);
+        pos_ += 2;
+        if (hi < lo) {
+          return std::nullopt;
+        }
+      }
+      for (int c = lo; c <= hi; c++) {
+        chars.set(c);
+      }
+    }
+    if (done()) {
+      return std::nullopt;
+    }
+    pos_++; // ']'
+    if (negate) {
+      chars.flip();
+    }
+    return chars;
+  }
+
+private:
+  std::string_view pattern_;
+  size_t pos_ = 0;
+  std::vector<CharSet> chars_;
+  std::vector<PositionSet> follow_;
+};
+
+} // namespace
+
+std::optional<RegexDfa> RegexDfa::compile(std::string_view pattern) {
+  Parser parser(pattern);
+  auto expr = parser.parse();
+  if (!expr) {
+    return std::nullopt;
+  }
+  // end marker, states containing it are accepting
+  auto end = parser.position(CharSet());
+  if (!end) {
+    return std::nullopt;
+  }
+  auto root = parser.concat(*expr, *end);
+  auto end_pos = parser.chars().size() - 1;
+
+  auto &chars = parser.chars();
+  auto &follow = parser.follow();
+
+  RegexDfa dfa;
+  std::vector<PositionSet> states;
+  std::unordered_map<PositionSet, uint16_t> state_index;
+
+  auto add_state = [&](const PositionSet &set) -> std::optional<uint16_t> {
+    if (auto itr = state_index.find(set); itr != state_index.end()) {
+      return itr->second;
+    }
+    if (states.size() == max_states) {
+      return std::nullopt;
+    }
+    uint16_t index = states.size();
+    states.push_back(set);
+    state_index.emplace(set, index);
+    dfa.accepting_.push_back(set[end_pos]);
+    dfa.next_.resize(dfa.next_.size() + 256, dead_state);
+    return index;
+  };
+
+  add_state(PositionSet());
+  add_state(root.first);
+
+  // states are appended while being iterated
+  for (size_t s = start_state; s < states.size(); s++) {
+    for (int c = 0; c < 256; c++) {
+      PositionSet next;
+      for (size_t p = 0; p < end_pos; p++) {
+        if (states[s][p] && chars[p][c]) {
+          next |= follow[p];
+        }
+      }
+      auto index = add_state(next);
+      if (!index) {
+        return std::nullopt;
+      }
+      dfa.next_[s * 256 + c] = *index;
+    }
+  }
+
+  return dfa;
+}
+
+} // namespace hm
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace hm {
+
+// Deterministic automaton of a regular expression, matched against a whole
+// string in a single pass without backtracking.
+//
+// Supported syntax: literals, '.', classes ("[a-z_]", "[^0-9]"), escapes
+// ("\d", "\w", "\s", their negations and escaped metacharacters), grouping,
+// alternation and the '*', '+' and '?' quantifiers. Anchors and counted
+// repetition are not supported, matches are always anchored.
+class RegexDfa {
+public:
+  // largest number of characters and states of an expression
+  constexpr static size_t max_positions = 256;
+  constexpr static size_t max_states = 4096;
+
+  // nullopt if |pattern| is malformed, unsupported or too large
+  static std::optional<RegexDfa> compile(std::string_view pattern);
+
+  bool match(std::string_view str) const {
+    uint32_t state = start_state;
+    for (auto ch : str) {
+      state = next_[state * 256 + static_cast<uint8_t>(ch)];
+      if (state == dead_state) {
+        return false;
+      }
+    }
+    return accepting_[state];
+  }
+
+  size_t num_states() const { return accepting_.size(); }
+
+private:
+  constexpr static uint32_t dead_state = 0;
+  constexpr static uint32_t start_state = 1;
+
+  RegexDfa() = default;
+
+  // transitions, 256 per state
+  std::vector<uint16_t> next_;
+  std::vector<bool> accepting_;
+};
+
+} // namespace hm
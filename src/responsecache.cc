@@ -0,0 +1,160 @@
+#include "responsecache.h"
+
+#include <bit>
+
+#include "httprouter.h"
+#include "stream.h"
+#include "worker.h"
+
+namespace hm {
+
+ResponseCache::ResponseCache(const CachePolicy &policy,
+                             const HttpRouter *router, size_t handler_index)
+    : policy_(policy), router_(router), handler_index_(handler_index) {
+  auto size = std::bit_ceil(std::max<size_t>(policy_.max_entries, 1));
+  slots_ = std::make_unique<std::atomic<Entry *>[]>(size);
+  mask_ = size - 1;
+}
+
+ResponseCache::~ResponseCache() {
+  // workers are gone, nothing reads the table anymore
+  for (size_t i = 0; i <= mask_; i++) {
+    delete slots_[i].load();
+  }
+}
+
+std::string_view ResponseCache::make_key(Stream *stream) {
+  // path, query and the varying headers separated by '\0'
+  auto size = stream->path_.size() + stream->query_.size();
+  std::vector<std::optional<std::string_view>> values;
+  for (auto &name : policy_.vary) {
+    auto &value = values.emplace_back(stream->headers.get_header(name));
+    size += 1 + (value ? value->size() : 0);
+  }
+
+  auto key = stream->arena_.alloc_string(size);
+  auto p = std::copy(stream->path_.begin(), stream->path_.end(), key);
+  p = std::copy(stream->query_.begin(), stream->query_.end(), p);
+  for (auto &value : values) {
+    *p++ = '\0';
+    if (value) {
+      p = std::copy(value->begin(), value->end(), p);
+    }
+  }
+  return {key, size};
+}
+
+std::atomic<ResponseCache::Entry *> &
+ResponseCache::slot(std::string_view key) {
+  return slots_[std::hash<std::string_view>{}(key) & mask_];
+}
+
+bool ResponseCache::lookup(Stream *stream) {
+  auto worker = Worker::get_worker();
+  auto &stats = worker->get_stats();
+  auto now = ev_now(worker->get_loop());
+  auto key = make_key(stream);
+
+  // valid until this worker's loop iteration ends, see Rcu
+  auto entry = slot(key).load(std::memory_order_acquire);
+  bool refresh = false;
+  if (entry && entry->key == key) {
+    if (now < entry->expires) {
+      stats.response_cache_hits.inc();
+      stream->submit_cached_response(entry->response);
+      return true;
+    }
+    if (now < entry->stale_until) {
+      if (entry->refreshing.exchange(true)) {
+        stats.response_cache_stale_hits.inc();
+        stream->submit_cached_response(entry->response);
+        return true;
+      }
+      refresh = true;
+    }
+  }
+
+  {
+    std::lock_guard lock(pending_mutex_);
+    auto [itr, inserted] = pending_.try_emplace(std::string(key));
+    if (!inserted) {
+      if (refresh) {
+        // already being filled, the stale response will do
+        stats.response_cache_stale_hits.inc();
+        stream->submit_cached_response(entry->response);
+        return true;
+      }
+      stats.response_cache_collapsed.inc();
+      itr->second.push_back({worker, stream->serial()});
+      return true;
+    }
+  }
+
+  stats.response_cache_misses.inc();
+  stream->cache_ = this;
+  stream->cache_key_ = key;
+  stream->cache_refresh_ = refresh;
+  return false;
+}
+
+std::vector<ResponseCache::Waiter>
+ResponseCache::take_waiters(std::string_view key) {
+  std::lock_guard lock(pending_mutex_);
+  auto itr = pending_.find(std::string(key));
+  if (itr == pending_.end()) {
+    return {};
+  }
+  auto waiters = std::move(itr->second);
+  pending_.erase(itr);
+  return waiters;
+}
+
+void ResponseCache::fill(Stream *stream, CachedResponse &&response) {
+  auto worker = Worker::get_worker();
+  auto now = ev_now(worker->get_loop());
+  auto key = stream->cache_key_;
+  stream->cache_ = nullptr;
+
+  auto entry = new Entry{.key = std::string(key),
+                         .response = std::move(response),
+                         .expires = now + policy_.ttl,
+                         .stale_until = now + policy_.ttl + policy_.stale_ttl};
+  auto old = slot(key).exchange(entry, std::memory_order_acq_rel);
+  if (old) {
+    worker->get_server()->get_rcu().retire([old] { delete old; });
+  }
+
+  // entry may be replaced and retired as soon as the waiters run, they get
+  // their own copy
+  for (auto waiter : take_waiters(key)) {
+    waiter.worker->post([response = entry->response, id = waiter.stream] {
+      if (auto stream = Worker::get_worker()->get_stream(id)) {
+        stream->submit_cached_response(response);
+      }
+    });
+  }
+}
+
+void ResponseCache::abort(Stream *stream) {
+  auto key = stream->cache_key_;
+  stream->cache_ = nullptr;
+
+  if (stream->cache_refresh_) {
+    // let a later request try again
+    auto entry = slot(key).load(std::memory_order_acquire);
+    if (entry && entry->key == key) {
+      entry->refreshing = false;
+    }
+  }
+
+  for (auto waiter : take_waiters(key)) {
+    waiter.worker->post([this, id = waiter.stream] {
+      if (auto stream = Worker::get_worker()->get_stream(id)) {
+        router_->invoke_handler(handler_index_, &stream->request_,
+                                &stream->response_);
+      }
+    });
+  }
+}
+
+} // namespace hm
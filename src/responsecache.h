@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace hm {
+
+class HttpRouter;
+class Stream;
+class Worker;
+
+// Opt-in caching of a GET route's responses. Only 200 responses are
+// cached, and only if they set no set-cookie header and no cache-control
+// private or no-store: a cached response is replayed to every client with
+// the same key.
+struct CachePolicy {
+  // seconds a response is served without running the handler
+  double ttl = 1.;
+  // seconds an expired response is still served while one request runs the
+  // handler to refresh it
+  double stale_ttl = 0.;
+  // request headers that are part of the key, besides path and query
+  std::vector<std::string> vary;
+  // slots of the table, rounded up to a power of two
+  size_t max_entries = 1024;
+};
+
+// immutable copy of a handler's response
+struct CachedResponse {
+  std::string status;
+  // response headers except content-length
+  std::vector<std::pair<std::string, std::string>> headers;
+  // shared with the streams sending it
+  std::shared_ptr<const std::string> body;
+};
+
+// Responses of one route, shared by all workers. Lookups are lock-free, a
+// direct mapped table of immutable entries replaced as a whole and freed
+// through Rcu. Concurrent misses of a key are collapsed: the first request
+// runs the handler, the others wait for its response.
+class ResponseCache {
+public:
+  ResponseCache(const CachePolicy &policy, const HttpRouter *router,
+                size_t handler_index);
+  ~ResponseCache();
+
+  // Serves |stream| from the cache or parks it until the response is
+  // filled. Returns false if the handler must run, its response then fills
+  // the cache (see fill() and abort()).
+  bool lookup(Stream *stream);
+
+  // |stream| is filling its key with a 200 response
+  void fill(Stream *stream, CachedResponse &&response);
+  // |stream| won't fill its key, waiting requests run the handler
+  void abort(Stream *stream);
+
+private:
+  struct Entry {
+    std::string key;
+    CachedResponse response;
+    double expires;
+    double stale_until;
+    // set by the request refreshing a stale entry
+    std::atomic<bool> refreshing = false;
+  };
+
+  // request parked on another miss of the same key
+  struct Waiter {
+    Worker *worker;
+    uint64_t stream;
+  };
+
+  std::string_view make_key(Stream *stream);
+  std::atomic<Entry *> &slot(std::string_view key);
+  // removes the waiters of |key|, so the caller can resume them
+  std::vector<Waiter> take_waiters(std::string_view key);
+
+  CachePolicy policy_;
+  const HttpRouter *router_;
+  size_t handler_index_;
+
+  std::unique_ptr<std::atomic<Entry *>[]> slots_;
+  size_t mask_;
+
+  // keys being filled and the requests waiting for them
+  std::mutex pending_mutex_;
+  std::unordered_map<std::string, std::vector<Waiter>> pending_;
+};
+
+} // namespace hm
@@ -0,0 +1,77 @@
+// Compares StaticRouter against HttpRouter on the same routes, build with
+//   cmake --build build --target router_bench
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include "httprouter.h"
+#include "staticrouter.h"
+
+namespace hm {
+
+static uint64_t handled = 0;
+
+static void handle(HttpRequest *, HttpResponse *) { handled++; }
+
+using Routes =
+    StaticRouter<Get<"/", handle>, Get<"/users", handle>,
+                 Get<"/users/{id:int}", handle>,
+                 Get<"/users/{id:int}/posts/{post:int}", handle>,
+                 Post<"/users/{id:int}/posts", handle>,
+                 Get<"/tags/{tag:[a-z]+}", handle>,
+                 Get<"/search/{term}", handle>, Get<"/files/**", handle>>;
+
+static const char *paths[] = {
+    "/users",   "/users/42",     "/users/42/posts/7", "/tags/cpp",
+    "/tags/C0", "/search/query", "/files/a/b/c.txt",  "/missing/path",
+};
+
+long elapsed(const std::chrono::high_resolution_clock::time_point &start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::high_resolution_clock::now() - start)
+      .count();
+}
+
+// friend of HttpRequest, which is otherwise only created by streams
+struct RouterBench {
+  constexpr static int iterations = 1000000;
+
+  static void run() {
+    HttpRouter router;
+    router.add_route(HttpMethod::GET, "/", handle);
+    router.add_route(HttpMethod::GET, "/users", handle);
+    router.add_route(HttpMethod::GET, "/users/{id:int}", handle);
+    router.add_route(HttpMethod::GET, "/users/{id:int}/posts/{post:int}",
+                     handle);
+    router.add_route(HttpMethod::POST, "/users/{id:int}/posts", handle);
+    router.add_route(HttpMethod::GET, "/tags/{tag:[a-z]+}", handle);
+    router.add_route(HttpMethod::GET, "/search/{term}", handle);
+    router.add_route(HttpMethod::GET, "/files/**", handle);
+    router.compile();
+    Routes::validate();
+
+    HttpRequest request(nullptr);
+    auto bench = [&](const char *name, auto &&dispatch) {
+      handled = 0;
+      auto t = std::chrono::high_resolution_clock::now();
+      for (int i = 0; i < iterations; i++) {
+        for (auto path : paths) {
+          dispatch(path);
+        }
+      }
+      auto time = elapsed(t);
+      std::cout << name << ": " << time / double(iterations * std::size(paths))
+                << " ns/dispatch, " << handled << " handled" << std::endl;
+    };
+    bench("HttpRouter", [&](const char *path) {
+      router.dispatch_route(HttpMethod::GET, path, &request, nullptr);
+    });
+    bench("StaticRouter", [&](const char *path) {
+      Routes::dispatch_route(HttpMethod::GET, path, &request, nullptr);
+    });
+  }
+};
+
+} // namespace hm
+
+int main() { hm::RouterBench::run(); }
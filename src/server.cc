@@ -9,13 +9,13 @@
 
 #include "filestream.h"
 #include "httpsession.h"
+#include "json.h"
 #include "server.h"
 #include "simdjson/padded_string.h"
 #include "util.h"
 #include "worker.h"
 
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
@@ -25,11 +25,22 @@
 #include <unistd.h>
 
 #include <openssl/decoder.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
 
 namespace hm {
 
+// leaves |out| untouched if |key| is missing or has the wrong type
+template <class T, class V>
+static void read_optional(simdjson::ondemand::object &obj, const char *key,
+                          V &out) {
+  T v;
+  if (obj[key].get(v) == simdjson::SUCCESS) {
+    out = static_cast<V>(v);
+  }
+}
+
 Server::Config Server::load_config(const char *config_file) {
   simdjson::ondemand::parser parser;
   auto json = simdjson::padded_string::load(config_file);
@@ -45,11 +56,128 @@ Server::Config Server::load_config(const char *config_file) {
                .static_dir = util::as_string(conf["static"]),
                .database_connection = util::as_string(conf["database"]),
                .query_dir = util::as_string(conf["queries"])};
+
+  simdjson::ondemand::object http2;
+  if (conf["http2"].get(http2) == simdjson::SUCCESS) {
+    auto &h2 = rt.http2;
+    read_optional<int64_t>(http2, "max_concurrent_streams",
+                           h2.max_concurrent_streams);
+    read_optional<int64_t>(http2, "initial_window_size",
+                           h2.initial_window_size);
+    read_optional<int64_t>(http2, "connection_window_size",
+                           h2.connection_window_size);
+    read_optional<int64_t>(http2, "max_frame_size", h2.max_frame_size);
+    read_optional<int64_t>(http2, "max_file_frame_size",
+                           h2.max_file_frame_size);
+    read_optional<bool>(http2, "window_autotune", h2.window_autotune);
+    read_optional<int64_t>(http2, "max_window_size", h2.max_window_size);
+
+    struct {
+      const char *rate_key;
+      const char *burst_key;
+      RateLimit &limit;
+    } limits[] = {
+        {"stream_rate", "stream_burst", h2.stream_limit},
+        {"rst_stream_rate", "rst_stream_burst", h2.rst_stream_limit},
+        {"settings_rate", "settings_burst", h2.settings_limit},
+        {"ping_rate", "ping_burst", h2.ping_limit},
+        {"empty_frame_rate", "empty_frame_burst", h2.empty_frame_limit}};
+
+    for (auto &[rate_key, burst_key, limit] : limits) {
+      read_optional<double>(http2, rate_key, limit.rate);
+      read_optional<double>(http2, burst_key, limit.burst);
+    }
+  }
+
+  simdjson::ondemand::object allocator;
+  if (conf["allocator"].get(allocator) == simdjson::SUCCESS) {
+    read_optional<bool>(allocator, "worker_arenas", rt.worker_arenas);
+    read_optional<int64_t>(allocator, "dirty_decay_ms",
+                           rt.arena.dirty_decay_ms);
+    read_optional<int64_t>(allocator, "muzzy_decay_ms",
+                           rt.arena.muzzy_decay_ms);
+
+    std::string_view huge_pages;
+    if (allocator["huge_pages"].get(huge_pages) == simdjson::SUCCESS) {
+      if (auto mode = huge_page_mode_from_string(huge_pages)) {
+        rt.huge_pages = *mode;
+      } else {
+        std::cerr << "Unknown huge_pages mode: " << huge_pages
+                  << ", expected off, madvise or hugetlb" << std::endl;
+      }
+    }
+  }
+
+  simdjson::ondemand::object file_cache;
+  if (conf["file_cache"].get(file_cache) == simdjson::SUCCESS) {
+    read_optional<int64_t>(file_cache, "size", rt.file_cache_size);
+    read_optional<int64_t>(file_cache, "max_file_size",
+                           rt.file_cache_max_file_size);
+  }
+
+  int64_t io_threads;
+  if (conf["io_threads"].get(io_threads) == simdjson::SUCCESS) {
+    rt.io_threads = io_threads;
+  }
+
+  bool admin;
+  if (conf["admin"].get(admin) == simdjson::SUCCESS) {
+    rt.admin = admin;
+  }
+  std::string_view admin_token;
+  if (conf["admin_token"].get(admin_token) == simdjson::SUCCESS) {
+    rt.admin_token = admin_token;
+  }
+
+  simdjson::ondemand::object compression;
+  if (conf["compression"].get(compression) == simdjson::SUCCESS) {
+    auto &policy = rt.compression;
+    read_optional<bool>(compression, "enabled", policy.enabled);
+    read_optional<int64_t>(compression, "min_size", policy.min_size);
+    read_optional<int64_t>(compression, "br_level", policy.br_level);
+    read_optional<int64_t>(compression, "gzip_level", policy.gzip_level);
+  }
+
+  simdjson::ondemand::object static_cache;
+  if (conf["static_cache"].get(static_cache) == simdjson::SUCCESS) {
+    std::string_view cache_control, manifest;
+    if (static_cache["cache_control"].get(cache_control) ==
+        simdjson::SUCCESS) {
+      rt.static_cache_control = cache_control;
+    }
+    read_optional<bool>(static_cache, "fingerprint", rt.fingerprint_assets);
+    if (static_cache["manifest"].get(manifest) == simdjson::SUCCESS) {
+      rt.asset_manifest_path = manifest;
+    }
+
+    simdjson::ondemand::object prefixes;
+    if (static_cache["prefixes"].get(prefixes) == simdjson::SUCCESS) {
+      for (auto field : prefixes) {
+        std::string_view prefix, value;
+        if (field.unescaped_key().get(prefix) == simdjson::SUCCESS &&
+            field.value().get(value) == simdjson::SUCCESS) {
+          rt.static_cache_prefixes.emplace_back(prefix, value);
+        }
+      }
+      // longest first, the first match wins
+      std::sort(rt.static_cache_prefixes.begin(),
+                rt.static_cache_prefixes.end(), [](auto &a, auto &b) {
+                  return a.first.size() > b.first.size();
+                });
+    }
+  }
+
+  bool compress_static;
+  if (conf["compress_static"].get(compress_static) == simdjson::SUCCESS) {
+    rt.compress_static_files = compress_static;
+  }
   return rt;
 }
 
 Server::Server(const Config &config)
-    : config_(config), ssl_ctx_(nullptr, nullptr) {
+    : config_(config),
+      file_cache_(config.file_cache_size, config.file_cache_max_file_size),
+      ssl_ctx_(nullptr, nullptr) {
   if (!instance_) {
     instance_ = this;
   } else {
@@ -57,6 +185,8 @@ Server::Server(const Config &config)
   }
 
   loop_ = ev_default_loop(0);
+  static_files_ =
+      std::make_unique<StaticFiles>(rcu_, config_.compress_static_files);
   for (int i = 0; i < config_.num_threads; i++) {
     auto worker = std::make_unique<Worker>(this);
     workers_.push_back(std::move(worker));
@@ -65,6 +195,86 @@ Server::Server(const Config &config)
   serve_static_files(config.static_dir);
   connect_database(config.database_connection.c_str());
   set_query_location(config.query_dir.c_str());
+
+  if (config_.admin) {
+    if (config_.admin_token.empty()) {
+      std::cerr << "admin is enabled without an admin_token, not serving "
+                   "/_admin/ endpoints"
+                << std::endl;
+    } else {
+      add_admin_routes();
+    }
+  }
+}
+
+// compares in constant time, the token must not leak through timing
+static bool check_admin_token(HttpRequest *req, const std::string &token) {
+  constexpr std::string_view scheme = "Bearer ";
+  auto auth = req->get_header("authorization");
+  if (!auth || !auth->starts_with(scheme)) {
+    return false;
+  }
+  auto given = auth->substr(scheme.size());
+  return given.size() == token.size() &&
+         CRYPTO_memcmp(given.data(), token.data(), token.size()) == 0;
+}
+
+void Server::add_admin_routes() {
+  // admin endpoints share the public listener, every one checks the token
+  auto guard = [this](auto handler) {
+    return [this, handler](HttpRequest *req, HttpResponse *res) {
+      if (!check_admin_token(req, config_.admin_token)) {
+        res->send_status_response("401", "Unauthorized");
+        return;
+      }
+      handler(req, res);
+    };
+  };
+
+  get("/_admin/stats", guard([this](HttpRequest *req, HttpResponse *res) {
+    json::Writer writer;
+    {
+      json::Object root = writer.root();
+      for (auto &[name, value] : get_stats()) {
+        root[name] = value;
+      }
+    }
+    res->send_json(writer.string());
+  }));
+
+  get("/_admin/allocator", guard([this](HttpRequest *req, HttpResponse *res) {
+    alloc::refresh_stats();
+    json::Writer writer;
+    {
+      json::Object root = writer.root();
+      json::Array workers = root["workers"];
+      for (auto &worker : workers_) {
+        json::Object obj = workers.next_object();
+        int arena = worker->get_arena();
+        obj["arena"] = arena;
+        if (auto stats = arena >= 0 ? alloc::get_arena_stats(arena)
+                                    : std::nullopt) {
+          obj["small_allocated"] = stats->small_allocated;
+          obj["large_allocated"] = stats->large_allocated;
+          obj["active"] = stats->active;
+          obj["dirty"] = stats->dirty;
+          obj["muzzy"] = stats->muzzy;
+          obj["nmalloc"] = stats->nmalloc;
+          obj["ndalloc"] = stats->ndalloc;
+        }
+      }
+    }
+    res->send_json(writer.string());
+  }));
+
+  post("/_admin/heap-profile", guard([](HttpRequest *req, HttpResponse *res) {
+    if (int rv = alloc::dump_heap_profile(); rv != 0) {
+      res->set_status("500");
+      res->send_json("{\"error\":\"heap profiling is not enabled\"}");
+      return;
+    }
+    res->send_json("{\"ok\":true}");
+  }));
 }
 
 Server::~Server() { workers_.clear(); }
@@ -157,6 +367,8 @@ Server::SSLContext Server::create_ssl_ctx() {
   SSL_CTX_set_options(ssl_ctx.get(), ssl_opts);
   SSL_CTX_set_mode(ssl_ctx.get(), SSL_MODE_AUTO_RETRY);
   SSL_CTX_set_mode(ssl_ctx.get(), SSL_MODE_RELEASE_BUFFERS);
+  // a retried write may be gathered again into the worker's record buffer
+  SSL_CTX_set_mode(ssl_ctx.get(), SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
   // set cipher list
   if (SSL_CTX_set_cipher_list(ssl_ctx.get(), util::tls::CIPHER_LIST) == 0) {
@@ -296,6 +508,8 @@ void Server::listen() {
 
   listener_fd_ = fd.value();
 
+  router_.compile();
+
   for (int i = 0; i < config_.num_threads; i++) {
     workers_[i]->run();
   }
@@ -321,6 +535,36 @@ void Server::listen() {
   ev_run(loop_, 0);
 }
 
+std::vector<std::pair<std::string_view, uint64_t>> Server::get_stats() {
+  std::vector<std::pair<std::string_view, uint64_t>> ret;
+  for (auto &worker : workers_) {
+    size_t i = 0;
+    worker->get_stats().visit([&](std::string_view name, uint64_t value) {
+      if (i == ret.size()) {
+        ret.emplace_back(name, 0);
+      }
+      ret[i++].second += value;
+    });
+  }
+  return ret;
+}
+
+std::string Server::asset_url(std::string_view relpath) {
+  if (!config_.fingerprint_assets) {
+    return std::string(relpath);
+  }
+  return static_files_->asset_url(relpath);
+}
+
+std::string_view Server::static_cache_control(std::string_view path) const {
+  for (auto &[prefix, cache_control] : config_.static_cache_prefixes) {
+    if (path.starts_with(prefix)) {
+      return cache_control;
+    }
+  }
+  return config_.static_cache_control;
+}
+
 void Server::serve_static_files(std::string path) {
   while (path.back() == ' ') {
     path.pop_back();
@@ -332,7 +576,12 @@ void Server::serve_static_files(std::string path) {
 
   static_root_ = std::move(path);
 
-  iterate_directory(static_root_);
+  // opened once, shared by all workers
+  auto files = static_files_->add_directory(static_root_);
+  for (auto &file : files) {
+    // relative path without compression extension
+    router_.add_static_file(file->relpath());
+  }
 }
 
 void Server::connect_database(const char *connection_string) {
@@ -347,31 +596,4 @@ void Server::set_query_location(const char *query_dir) {
   }
 }
 
-void Server::iterate_directory(std::string path) {
-  DIR *dir;
-  dirent *de;
-
-  if ((dir = opendir(path.c_str())) == nullptr) {
-    std::cerr << "Couldn't open directory:" << path << ". No such directory"
-              << std::endl;
-    return;
-  }
-
-  while ((de = readdir(dir))) {
-    if (de->d_name[0] == '.') {
-      continue;
-    }
-    if (de->d_type & DT_DIR) {
-      iterate_directory(path + de->d_name + "/");
-    } else if (de->d_type & DT_REG | de->d_type & DT_LNK) {
-      // add to all thread workers
-      for (int i = 0; i < config_.num_threads; i++) {
-        workers_[i]->add_static_file(path + de->d_name, true);
-      }
-    }
-  }
-
-  closedir(dir);
-}
-
 } // namespace hm
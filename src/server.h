@@ -1,6 +1,13 @@
 #pragma once
 
+#include "allocator.h"
+#include "filecache.h"
 #include "httprouter.h"
+#include "hugepages.h"
+#include "ratelimit.h"
+#include "rcu.h"
+#include "responsecache.h"
+#include "staticfiles.h"
 #include <memory>
 #include <optional>
 #include <thread>
@@ -27,6 +34,32 @@ class Server {
   inline static Server *instance_ = nullptr;
 
 public:
+  // HTTP/2 SETTINGS and flow control parameters sent to every client
+  struct Http2Config {
+    uint32_t max_concurrent_streams = 100;
+    // SETTINGS_INITIAL_WINDOW_SIZE, receive window of each stream
+    int32_t initial_window_size = (1 << 16) - 1;
+    // receive window of the whole connection
+    int32_t connection_window_size = (1 << 16) - 1;
+    // SETTINGS_MAX_FRAME_SIZE, largest frame payload we accept
+    uint32_t max_frame_size = 16 * 1024;
+    // largest DATA frame payload we send for file responses, still bounded
+    // by the peer's SETTINGS_MAX_FRAME_SIZE
+    size_t max_file_frame_size = 60 * 1024;
+    // grow receive windows from bandwidth-delay product estimated with PING
+    bool window_autotune = true;
+    // upper bound for autotuned windows
+    int32_t max_window_size = 16 * 1024 * 1024;
+    // per connection rate limits of stream creation and control frames
+    // received, exhausting any of them terminates the session with
+    // ENHANCE_YOUR_CALM
+    RateLimit stream_limit = {.rate = 200., .burst = 500.};
+    RateLimit rst_stream_limit = {.rate = 50., .burst = 200.};
+    RateLimit settings_limit = {.rate = 5., .burst = 20.};
+    RateLimit ping_limit = {.rate = 5., .burst = 20.};
+    RateLimit empty_frame_limit = {.rate = 5., .burst = 20.};
+  };
+
   struct Config {
     int num_threads;
     double timeout;
@@ -37,6 +70,34 @@ public:
     std::string static_dir;
     std::string database_connection;
     std::string query_dir;
+    Http2Config http2;
+    // give every worker thread its own jemalloc arena
+    bool worker_arenas = true;
+    alloc::ArenaConfig arena;
+    // back I/O buffer pools with huge pages
+    HugePageMode huge_pages = HugePageMode::OFF;
+    // serve /_admin/ endpoints (worker counters, allocator stats, heap
+    // profiles) to requests with "authorization: Bearer <admin_token>".
+    // Not served without a token
+    bool admin = false;
+    std::string admin_token;
+    // compress static files on demand for clients accepting br or gzip
+    bool compress_static_files = true;
+    // compression of dynamic responses, unless the route has its own
+    CompressPolicy compression;
+    // bytes of small static files kept in memory, 0 disables it
+    size_t file_cache_size = 64 << 20;
+    size_t file_cache_max_file_size = 64 << 10;
+    // threads per worker reading files that aren't in the page cache
+    size_t io_threads = 2;
+    // cache-control of static files, unless a prefix of their path has its
+    // own (the longest one wins)
+    std::string static_cache_control = "max-age=0";
+    std::vector<std::pair<std::string, std::string>> static_cache_prefixes;
+    // serve files at their asset_url() as immutable, and the manifest of
+    // these URLs at asset_manifest_path
+    bool fingerprint_assets = false;
+    std::string asset_manifest_path = "/asset-manifest.json";
   };
 
   static Config load_config(const char *config_file);
@@ -53,13 +114,40 @@ public:
               std::invocable<HttpRequest *, HttpResponse *> auto &&cb);
   Server &post(const char *route,
                std::invocable<HttpRequest *, HttpResponse *> auto &&cb);
+  // responses of the handler are compressed as described by |compress|
+  Server &get(const char *route,
+              std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+              const CompressPolicy &compress);
+  Server &post(const char *route,
+               std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+               const CompressPolicy &compress);
+  // responses of the handler are cached as described by |cache|
+  Server &get(const char *route,
+              std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+              const CachePolicy &cache);
+
+  // routes of a StaticRouter, tried before the ones added with get()/post()
+  template <class Router> Server &use_routes();
 
   void listen();
 
+  // sums counters of all workers
+  std::vector<std::pair<std::string_view, uint64_t>> get_stats();
+
   friend Server *get_server() { return Server::instance_; }
 
+  Rcu &get_rcu() { return rcu_; }
+
+  // URL of the static file |relpath| that changes with its contents, e.g.
+  // for pages linking to it. |relpath| unless fingerprint_assets is set and
+  // the contents of the file were hashed. Call from handlers.
+  std::string asset_url(std::string_view relpath);
+
 private:
-  void iterate_directory(std::string path);
+  // cache-control of the static file at |path|
+  std::string_view static_cache_control(std::string_view path) const;
+
+  void add_admin_routes();
 
   std::pair<int, std::optional<int>> start_listen();
   SSLContext create_ssl_ctx();
@@ -70,6 +158,11 @@ private:
 private:
   Config config_;
 
+  // outlives workers and everything they read
+  Rcu rcu_;
+  std::unique_ptr<StaticFiles> static_files_;
+  FileCache file_cache_;
+
   size_t next_worker_ = 0;
   int listener_fd_ = -1;
 
@@ -80,6 +173,8 @@ private:
   std::string static_root_;
 
   HttpRouter router_;
+  bool (*static_dispatch_)(HttpMethod, std::string_view, HttpRequest *,
+                           HttpResponse *) = nullptr;
   std::vector<std::unique_ptr<Worker>> workers_;
 };
 
@@ -89,10 +184,40 @@ Server &Server::get(const char *route,
   return *this;
 }
 
+Server &Server::get(const char *route,
+                    std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+                    const CachePolicy &cache) {
+  router_.add_route(HttpMethod::GET, route, std::forward<decltype(cb)>(cb),
+                    &cache);
+  return *this;
+}
+
 Server &Server::post(const char *route,
                      std::invocable<HttpRequest *, HttpResponse *> auto &&cb) {
   router_.add_route(HttpMethod::POST, route, std::forward<decltype(cb)>(cb));
   return *this;
 }
 
+Server &Server::get(const char *route,
+                    std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+                    const CompressPolicy &compress) {
+  router_.add_route(HttpMethod::GET, route, std::forward<decltype(cb)>(cb),
+                    nullptr, &compress);
+  return *this;
+}
+
+Server &Server::post(const char *route,
+                     std::invocable<HttpRequest *, HttpResponse *> auto &&cb,
+                     const CompressPolicy &compress) {
+  router_.add_route(HttpMethod::POST, route, std::forward<decltype(cb)>(cb),
+                    nullptr, &compress);
+  return *this;
+}
+
+template <class Router> Server &Server::use_routes() {
+  Router::validate();
+  static_dispatch_ = &Router::dispatch_route;
+  return *this;
+}
+
 } // namespace hm
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace hm {
+
+// Object pool allocating slots in fixed size chunks. Freed slots are reused
+// most recently freed first. Every slot carries a generation which is bumped
+// when its object is destroyed, so a handle (generation + slot index) of a
+// destroyed object never resolves to whatever reuses the slot.
+template <class T, size_t ChunkSize = 64> class Slab {
+  struct Slot {
+    // must stay the first member, objects are converted back to slots
+    alignas(T) std::byte storage[sizeof(T)];
+    uint32_t index;
+    uint32_t generation;
+    bool occupied;
+  };
+
+public:
+  using handle_type = uint64_t;
+
+  Slab() = default;
+  Slab(const Slab &) = delete;
+  Slab &operator=(const Slab &) = delete;
+
+  ~Slab() { clear(); }
+
+  template <class... Args> T *emplace(Args &&...args) {
+    if (free_.empty()) {
+      grow();
+    }
+    auto &slot = at(free_.back());
+    auto obj = new (slot.storage) T(std::forward<Args>(args)...);
+    free_.pop_back();
+    slot.occupied = true;
+    size_++;
+    return obj;
+  }
+
+  void destroy(T *obj) {
+    auto &slot = slot_of(obj);
+    assert(slot.occupied);
+    // mark first, destructor may look up handles
+    slot.occupied = false;
+    slot.generation++;
+    obj->~T();
+    free_.push_back(slot.index);
+    size_--;
+  }
+
+  // valid as soon as the object is being constructed
+  handle_type handle(const T *obj) const {
+    auto &slot = slot_of(const_cast<T *>(obj));
+    return (handle_type)slot.generation << 32 | slot.index;
+  }
+
+  // returns nullptr if the object was destroyed
+  T *get(handle_type handle) {
+    auto index = (uint32_t)handle;
+    if (index >= chunks_.size() * ChunkSize) {
+      return nullptr;
+    }
+    auto &slot = at(index);
+    if (!slot.occupied || slot.generation != (uint32_t)(handle >> 32)) {
+      return nullptr;
+    }
+    return std::launder(reinterpret_cast<T *>(slot.storage));
+  }
+
+  void clear() {
+    for (uint32_t i = 0; i < chunks_.size() * ChunkSize; i++) {
+      if (auto &slot = at(i); slot.occupied) {
+        destroy(std::launder(reinterpret_cast<T *>(slot.storage)));
+      }
+    }
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  Slot &at(uint32_t index) {
+    return chunks_[index / ChunkSize][index % ChunkSize];
+  }
+
+  static Slot &slot_of(T *obj) { return *reinterpret_cast<Slot *>(obj); }
+
+  void grow() {
+    auto base = (uint32_t)(chunks_.size() * ChunkSize);
+    auto &chunk = chunks_.emplace_back(new Slot[ChunkSize]);
+    // push in reverse so lower indices are handed out first
+    for (uint32_t i = ChunkSize; i-- > 0;) {
+      chunk[i].index = base + i;
+      chunk[i].generation = 0;
+      chunk[i].occupied = false;
+      free_.push_back(base + i);
+    }
+  }
+
+private:
+  std::vector<std::unique_ptr<Slot[]>> chunks_;
+  std::vector<uint32_t> free_;
+  size_t size_ = 0;
+};
+
+} // namespace hm
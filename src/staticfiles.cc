@@ -0,0 +1,715 @@
+#include "staticfiles.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace hm {
+
+StaticFiles::Table::Table() {
+  for (auto &shard : shards) {
+    shard = std::make_shared<Files>();
+  }
+}
+
+StaticFiles::Table::Table(const Table &table) : shards(table.shards) {}
+
+StaticFiles::Table::Files &
+StaticFiles::Table::mutable_shard(std::string_view relpath) {
+  auto index = shard_index(relpath);
+  if (!owned[index]) {
+    // the published table keeps reading the original
+    shards[index] = std::make_shared<Files>(*shards[index]);
+    owned[index] = true;
+  }
+  return *shards[index];
+}
+
+void StaticFiles::Table::modify(std::string_view relpath,
+                                const std::function<void(Variants &)> &fn) {
+  auto &files = mutable_shard(relpath);
+  Variants variants;
+  if (auto itr = files.find(relpath); itr != files.end()) {
+    // the key points into one of the entries, it is added back below
+    variants = std::move(itr->second);
+    files.erase(itr);
+  }
+  fn(variants);
+
+  // the same version of a file may have been replaced by its hashed entry
+  auto is_present = [&](const FileEntry &source) {
+    return std::any_of(variants.begin(), variants.end(), [&](auto &file) {
+      return file->path() == source.path() &&
+             file->stat_fingerprint() == source.stat_fingerprint();
+    });
+  };
+  std::erase_if(variants, [&](auto &file) {
+    return file->source() && !is_present(*file->source());
+  });
+  if (!variants.empty()) {
+    files.emplace(variants[0]->relpath(), std::move(variants));
+  }
+}
+
+void StaticFiles::Table::insert(std::shared_ptr<FileEntry> file) {
+  modify(file->relpath(), [&](Variants &variants) {
+    auto same = std::find_if(variants.begin(), variants.end(), [&](auto &v) {
+      return v->path() == file->path();
+    });
+    if (same == variants.end()) {
+      variants.push_back(std::move(file));
+    } else {
+      *same = std::move(file);
+    }
+  });
+}
+
+void StaticFiles::Table::replace(const FileEntry *old,
+                                 std::shared_ptr<FileEntry> file) {
+  auto is_old = [&](auto &v) { return v.get() == old; };
+  auto &current = shard(old->relpath());
+  if (auto itr = current.find(old->relpath());
+      itr == current.end() || std::none_of(itr->second.begin(),
+                                           itr->second.end(), is_old)) {
+    // the shard isn't copied for nothing
+    return;
+  }
+  auto &files = mutable_shard(old->relpath());
+  auto itr = files.find(old->relpath());
+  auto &variants = itr->second;
+  *std::find_if(variants.begin(), variants.end(), is_old) = std::move(file);
+  // the key may point into |old|, re-added with the new entry's
+  auto moved = std::move(variants);
+  files.erase(itr);
+  files.emplace(moved[0]->relpath(), std::move(moved));
+}
+
+void StaticFiles::Table::erase(std::string_view relpath,
+                               std::string_view path) {
+  if (!shard(relpath).contains(relpath)) {
+    return;
+  }
+  modify(relpath, [&](Variants &variants) {
+    std::erase_if(variants, [&](auto &v) { return v->path() == path; });
+  });
+}
+
+void StaticFiles::Table::erase_path(std::string_view path, size_t root_len) {
+  // keyed without the encoding suffix if it is a compressed variant
+  auto relpath = path.substr(root_len);
+  erase(relpath, path);
+  auto dot = relpath.find_last_of('.');
+  if (dot != relpath.npos) {
+    erase(relpath.substr(0, dot), path);
+  }
+}
+
+void StaticFiles::Table::erase_below(std::string_view dir) {
+  std::vector<std::pair<std::string, std::string>> below;
+  for (auto &files : shards) {
+    for (auto &[relpath, variants] : *files) {
+      for (auto &file : variants) {
+        if (file->path().starts_with(dir)) {
+          below.emplace_back(relpath, file->path());
+        }
+      }
+    }
+  }
+  for (auto &[relpath, path] : below) {
+    erase(relpath, path);
+  }
+}
+
+namespace {
+
+constexpr uint32_t dir_mask = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE |
+                              IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM |
+                              IN_ONLYDIR;
+// a file replaced by rename() is a new inode, its watch ends
+constexpr uint32_t file_mask =
+    IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+} // namespace
+
+StaticFiles::StaticFiles(Rcu &rcu, bool compress)
+    : rcu_(rcu), table_(new Table), compress_(compress) {
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ == -1) {
+    std::cerr << "inotify_init1: " << strerror(errno)
+              << ", static files won't be updated" << std::endl;
+  }
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  thread_ = std::thread([this] { run(); });
+  background_thread_ = std::thread([this] { background_loop(); });
+}
+
+StaticFiles::~StaticFiles() {
+  uint64_t one = 1;
+  write(stop_fd_, &one, sizeof(one));
+  thread_.join();
+  {
+    std::lock_guard lock(background_mutex_);
+    background_stop_ = true;
+  }
+  background_cv_.notify_one();
+  background_thread_.join();
+  close(stop_fd_);
+  if (inotify_fd_ != -1) {
+    close(inotify_fd_);
+  }
+  // readers are gone
+  delete table_.load();
+}
+
+template <class Usable>
+std::shared_ptr<FileEntry>
+StaticFiles::select(const Table::Variants &variants,
+                    const AcceptEncoding &accept, Usable &&usable) {
+  const std::shared_ptr<FileEntry> *best = nullptr, *identity = nullptr;
+  for (auto &file : variants) {
+    if (!usable(*file)) {
+      continue;
+    }
+    auto encoding = file->encoding();
+    if (encoding == ContentEncoding::IDENTITY) {
+      identity = &file;
+    }
+    if (accept.accepts(encoding) &&
+        (!best || accept.prefers(encoding, (*best)->encoding()))) {
+      best = &file;
+    }
+  }
+  if (compress_ && identity) {
+    request_variant(*identity,
+                    best ? (*best)->encoding() : ContentEncoding::IDENTITY,
+                    accept);
+  }
+  if (best) {
+    return *best;
+  }
+  // nothing acceptable, sent as is rather than 406
+  return identity ? *identity : variants.back();
+}
+
+std::shared_ptr<FileEntry> StaticFiles::find(std::string_view relpath,
+                                             const AcceptEncoding &accept) {
+  // valid until the calling worker's loop iteration ends, see Rcu
+  auto &files = table_.load(std::memory_order_acquire)->shard(relpath);
+  auto itr = files.find(relpath);
+  if (itr == files.end()) {
+    return nullptr;
+  }
+  return select(itr->second, accept, [](const FileEntry &) { return true; });
+}
+
+const FileEntry *StaticFiles::identity(const Table::Variants &variants) {
+  for (auto &file : variants) {
+    if (!file->compressed()) {
+      return file.get();
+    }
+  }
+  return nullptr;
+}
+
+std::string StaticFiles::make_asset_url(std::string_view relpath,
+                                        std::string_view fingerprint) {
+  auto name = relpath.rfind('/') + 1;
+  auto dot = relpath.find_last_of('.');
+  if (dot == relpath.npos || dot < name) {
+    dot = relpath.size();
+  }
+  std::string url(relpath.substr(0, dot));
+  url += '.';
+  url += fingerprint;
+  url += relpath.substr(dot);
+  return url;
+}
+
+std::string StaticFiles::asset_url(std::string_view relpath) {
+  // valid until the calling thread's next quiescent state, see Rcu
+  auto &files = table_.load(std::memory_order_acquire)->shard(relpath);
+  auto itr = files.find(relpath);
+  if (itr != files.end()) {
+    // a fingerprint from the metadata could name different contents later
+    if (auto file = identity(itr->second); file && file->hashed()) {
+      return make_asset_url(relpath, file->fingerprint());
+    }
+  }
+  return std::string(relpath);
+}
+
+std::shared_ptr<FileEntry>
+StaticFiles::resolve_asset(std::string_view path,
+                           const AcceptEncoding &accept) {
+  auto name = path.rfind('/') + 1;
+  auto table = table_.load(std::memory_order_acquire);
+
+  // the fingerprint is before the extension or, without one, last
+  for (auto end : {path.find_last_of('.'), path.size()}) {
+    if (end == path.npos || end < name + FileEntry::fingerprint_size + 1) {
+      continue;
+    }
+    auto begin = end - FileEntry::fingerprint_size;
+    auto fingerprint = path.substr(begin, FileEntry::fingerprint_size);
+    if (path[begin - 1] != '.' ||
+        fingerprint.find_first_not_of("0123456789abcdef") !=
+            fingerprint.npos) {
+      continue;
+    }
+
+    std::string relpath(path.substr(0, begin - 1));
+    relpath += path.substr(end);
+    auto &files = table->shard(relpath);
+    auto itr = files.find(relpath);
+    if (itr == files.end()) {
+      continue;
+    }
+    auto file = identity(itr->second);
+    if (!file || !file->hashed() || file->fingerprint() != fingerprint) {
+      continue;
+    }
+    // the matched version and what the server compressed from it, files
+    // compressed on disk may not be of the same version
+    return select(itr->second, accept, [&](const FileEntry &variant) {
+      auto &source = variant.source();
+      return &variant == file ||
+             (source && source->path() == file->path() &&
+              source->stat_fingerprint() == file->stat_fingerprint());
+    });
+  }
+  return nullptr;
+}
+
+std::string StaticFiles::asset_manifest() {
+  std::vector<std::pair<std::string_view, std::string>> assets;
+  auto table = table_.load(std::memory_order_acquire);
+  for (auto &files : table->shards) {
+    for (auto &[relpath, variants] : *files) {
+      if (auto file = identity(variants); file && file->hashed()) {
+        assets.emplace_back(relpath,
+                            make_asset_url(relpath, file->fingerprint()));
+      }
+    }
+  }
+  std::sort(assets.begin(), assets.end());
+
+  std::string json = "{";
+  for (auto &[relpath, url] : assets) {
+    if (json.size() > 1) {
+      json += ',';
+    }
+    util::append_quoted_string(relpath, json);
+    json += ':';
+    util::append_quoted_string(url, json);
+  }
+  json += '}';
+  return json;
+}
+
+void StaticFiles::update(const std::function<void(Table &)> &fn) {
+  std::lock_guard lock(update_mutex_);
+  // only updates replace the table, it can't be retired under us. Shards
+  // live as long as a table refers to them
+  auto table = new Table(*table_.load());
+  fn(*table);
+  auto old = table_.exchange(table, std::memory_order_acq_rel);
+  generation_.fetch_add(1, std::memory_order_acq_rel);
+  rcu_.retire([old] { delete old; });
+}
+
+std::vector<std::shared_ptr<FileEntry>>
+StaticFiles::add_directory(std::string root) {
+  if (root.back() != '/') {
+    root += '/';
+  }
+  auto root_len = root.size() - 1;
+
+  std::vector<std::string> paths;
+  {
+    // watched before listing, files created in between aren't missed
+    std::lock_guard lock(watch_mutex_);
+    roots_.emplace_back(root, root_len);
+    watch_tree(root, root_len, paths);
+  }
+
+  std::vector<std::shared_ptr<FileEntry>> files;
+  for (auto &path : paths) {
+    if (auto file = FileEntry::create(std::move(path), root_len)) {
+      files.push_back(std::move(file));
+    }
+  }
+  update([&](Table &table) {
+    for (auto &file : files) {
+      table.insert(file);
+    }
+  });
+  request_hashes(files);
+  return files;
+}
+
+std::vector<std::shared_ptr<FileEntry>>
+StaticFiles::add(std::vector<std::string> paths, size_t root_len,
+                 bool watch) {
+  std::vector<std::shared_ptr<FileEntry>> files;
+  for (auto &path : paths) {
+    if (access(path.c_str(), R_OK) != 0) {
+      continue;
+    }
+    if (auto file = FileEntry::create(path, root_len)) {
+      files.push_back(std::move(file));
+    }
+  }
+  if (files.empty()) {
+    return files;
+  }
+
+  if (watch && inotify_fd_ != -1) {
+    std::lock_guard lock(watch_mutex_);
+    for (auto &file : files) {
+      auto path = std::string(file->path());
+      auto wd = inotify_add_watch(inotify_fd_, path.c_str(), file_mask);
+      if (wd != -1) {
+        watches_[wd] = {std::move(path), root_len, false};
+      }
+    }
+  }
+
+  update([&](Table &table) {
+    for (auto &file : files) {
+      table.insert(file);
+    }
+  });
+  request_hashes(files);
+  return files;
+}
+
+void StaticFiles::watch_tree(const std::string &dir, size_t root_len,
+                             std::vector<std::string> &files) {
+  if (inotify_fd_ != -1) {
+    auto wd = inotify_add_watch(inotify_fd_, dir.c_str(), dir_mask);
+    if (wd != -1) {
+      watches_[wd] = {dir, root_len, true};
+    } else {
+      std::cerr << "Couldn't watch directory: " << dir << ": "
+                << strerror(errno) << std::endl;
+    }
+  }
+
+  DIR *d;
+  dirent *de;
+  if ((d = opendir(dir.c_str())) == nullptr) {
+    std::cerr << "Couldn't open directory:" << dir << ". No such directory"
+              << std::endl;
+    return;
+  }
+  while ((de = readdir(d))) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    if (de->d_type == DT_DIR) {
+      watch_tree(dir + de->d_name + "/", root_len, files);
+    } else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
+      files.push_back(dir + de->d_name);
+    }
+  }
+  closedir(d);
+}
+
+void StaticFiles::unwatch_tree(std::string_view dir) {
+  std::erase_if(watches_, [&](auto &watch) {
+    if (!watch.second.path.starts_with(dir)) {
+      return false;
+    }
+    inotify_rm_watch(inotify_fd_, watch.first);
+    return true;
+  });
+}
+
+void StaticFiles::run() {
+  if (inotify_fd_ == -1) {
+    return;
+  }
+  pollfd fds[] = {{.fd = inotify_fd_, .events = POLLIN},
+                  {.fd = stop_fd_, .events = POLLIN}};
+  alignas(inotify_event) char buf[16384];
+  std::vector<Change> changes;
+
+  for (;;) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "poll: " << strerror(errno) << std::endl;
+      return;
+    }
+    if (fds[1].revents) {
+      return;
+    }
+    // everything queued goes into one update
+    ssize_t len;
+    while ((len = read(inotify_fd_, buf, sizeof(buf))) > 0) {
+      read_events(buf, len, changes);
+    }
+    apply(changes);
+    changes.clear();
+  }
+}
+
+void StaticFiles::read_events(const char *buf, size_t len,
+                              std::vector<Change> &changes) {
+  std::lock_guard lock(watch_mutex_);
+
+  for (size_t pos = 0; pos < len;) {
+    auto event = reinterpret_cast<const inotify_event *>(buf + pos);
+    pos += sizeof(inotify_event) + event->len;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+      // events were dropped
+      resync(changes);
+      continue;
+    }
+    auto itr = watches_.find(event->wd);
+    if (itr == watches_.end()) {
+      continue;
+    }
+    if (event->mask & IN_IGNORED) {
+      watches_.erase(itr);
+      continue;
+    }
+    auto &watch = itr->second;
+
+    if (!watch.dir) {
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        changes.push_back({Change::ERASE, watch.path, watch.root_len});
+      } else {
+        changes.push_back({Change::INSERT, watch.path, watch.root_len});
+      }
+      continue;
+    }
+
+    if (event->len == 0 || event->name[0] == '.') {
+      continue;
+    }
+    auto path = watch.path + event->name;
+    auto root_len = watch.root_len;
+
+    if (event->mask & IN_ISDIR) {
+      path += '/';
+      if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        changes.push_back({Change::ERASE_BELOW, path, root_len});
+        unwatch_tree(path);
+      } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        std::vector<std::string> files;
+        watch_tree(path, root_len, files);
+        for (auto &file : files) {
+          changes.push_back({Change::INSERT, std::move(file), root_len});
+        }
+      }
+      continue;
+    }
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      changes.push_back({Change::ERASE, std::move(path), root_len});
+    } else if (event->mask & IN_CREATE) {
+      // a written file is added once closed, links are complete right away
+      struct stat st;
+      if (lstat(path.c_str(), &st) == 0 &&
+          (!S_ISREG(st.st_mode) || st.st_nlink > 1)) {
+        changes.push_back({Change::INSERT, std::move(path), root_len});
+      }
+    } else {
+      changes.push_back({Change::INSERT, std::move(path), root_len});
+    }
+  }
+}
+
+void StaticFiles::resync(std::vector<Change> &changes) {
+  for (auto &[root, root_len] : roots_) {
+    changes.push_back({Change::ERASE_BELOW, root, root_len});
+    std::vector<std::string> files;
+    watch_tree(root, root_len, files);
+    for (auto &file : files) {
+      changes.push_back({Change::INSERT, std::move(file), root_len});
+    }
+  }
+}
+
+void StaticFiles::apply(std::vector<Change> &changes) {
+  if (changes.empty()) {
+    return;
+  }
+  for (auto &change : changes) {
+    if (change.type == Change::INSERT) {
+      // may fail if it is already gone again, a later change erases it
+      change.file = FileEntry::create(change.path, change.root_len);
+    }
+  }
+  update([&](Table &table) {
+    for (auto &change : changes) {
+      switch (change.type) {
+      case Change::INSERT:
+        if (change.file) {
+          table.insert(change.file);
+        }
+        break;
+      case Change::ERASE:
+        table.erase_path(change.path, change.root_len);
+        break;
+      case Change::ERASE_BELOW:
+        table.erase_below(change.path);
+        break;
+      }
+    }
+  });
+
+  std::vector<std::shared_ptr<FileEntry>> opened;
+  for (auto &change : changes) {
+    if (change.file) {
+      opened.push_back(std::move(change.file));
+    }
+  }
+  request_hashes(std::move(opened));
+}
+
+void StaticFiles::request_variant(const std::shared_ptr<FileEntry> &source,
+                                  ContentEncoding served,
+                                  const AcceptEncoding &accept) {
+  auto &file = *source;
+  if (!file.compressible()) {
+    return;
+  }
+  auto wanted = accept.prefers(ContentEncoding::BR, ContentEncoding::GZIP)
+                    ? ContentEncoding::BR
+                    : ContentEncoding::GZIP;
+  if (!accept.accepts(wanted) || !accept.prefers(wanted, served)) {
+    return;
+  }
+  auto length = static_cast<size_t>(file.info().length);
+  if (length < min_compress_size || length > max_compress_size) {
+    return;
+  }
+  // once per entry and encoding, a changed file is a new entry
+  uint8_t bit = 1 << static_cast<int>(wanted);
+  if (file.compress_requested_.fetch_or(bit, std::memory_order_relaxed) &
+      bit) {
+    return;
+  }
+
+  {
+    std::lock_guard lock(background_mutex_);
+    background_queue_.push_back({Job::COMPRESS, source, wanted});
+  }
+  background_cv_.notify_one();
+}
+
+void StaticFiles::request_hashes(
+    std::vector<std::shared_ptr<FileEntry>> files) {
+  std::stable_sort(files.begin(), files.end(), [](auto &a, auto &b) {
+    return Table::shard_index(a->relpath()) < Table::shard_index(b->relpath());
+  });
+  {
+    std::lock_guard lock(background_mutex_);
+    for (auto &file : files) {
+      if (static_cast<size_t>(file->info().length) <=
+          FileEntry::max_hashed_size) {
+        background_queue_.push_back({Job::HASH, file});
+      }
+    }
+  }
+  background_cv_.notify_one();
+}
+
+void StaticFiles::background_loop() {
+  std::unique_lock lock(background_mutex_);
+  for (;;) {
+    background_cv_.wait(lock, [this] {
+      return background_stop_ || !background_queue_.empty();
+    });
+    if (background_stop_) {
+      return;
+    }
+    std::vector<Job> jobs;
+    do {
+      jobs.push_back(std::move(background_queue_.front()));
+      background_queue_.pop_front();
+    } while (jobs.back().type == Job::HASH && jobs.size() < hash_batch &&
+             !background_queue_.empty() &&
+             background_queue_.front().type == Job::HASH);
+    lock.unlock();
+    if (jobs[0].type == Job::COMPRESS) {
+      compress_file(jobs[0]);
+    } else {
+      hash_files(jobs);
+    }
+    lock.lock();
+  }
+}
+
+void StaticFiles::hash_files(std::vector<Job> &jobs) {
+  std::vector<std::pair<const FileEntry *, std::shared_ptr<FileEntry>>>
+      hashed;
+  for (auto &job : jobs) {
+    if (auto file = FileEntry::create_hashed(*job.file)) {
+      hashed.emplace_back(job.file.get(), std::move(file));
+    }
+  }
+  if (hashed.empty()) {
+    return;
+  }
+  update([&](Table &table) {
+    for (auto &[old, file] : hashed) {
+      table.replace(old, std::move(file));
+    }
+  });
+}
+
+void StaticFiles::compress_file(Job &job) {
+  auto data = job.file->read();
+  if (!data) {
+    return;
+  }
+  auto compressed = compress(job.encoding, *data);
+  if (!compressed || compressed->size() >= data->size()) {
+    // not worth it, stays requested so it isn't tried again
+    return;
+  }
+
+  int fd = memfd_create(std::string(job.file->relpath()).c_str(),
+                        MFD_CLOEXEC);
+  if (fd == -1) {
+    std::cerr << "memfd_create: " << strerror(errno) << std::endl;
+    return;
+  }
+  for (size_t pos = 0; pos < compressed->size();) {
+    auto nwrite =
+        write(fd, compressed->data() + pos, compressed->size() - pos);
+    if (nwrite == -1 && errno == EINTR) {
+      continue;
+    }
+    if (nwrite == -1) {
+      std::cerr << "write to memfd: " << strerror(errno) << std::endl;
+      close(fd);
+      return;
+    }
+    pos += nwrite;
+  }
+
+  auto variant =
+      FileEntry::create_variant(fd, std::move(job.file), job.encoding);
+  // dropped right away if the source was replaced meanwhile
+  update([&](Table &table) { table.insert(std::move(variant)); });
+}
+
+} // namespace hm
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "compression.h"
+#include "fileentry.h"
+#include "rcu.h"
+
+namespace hm {
+
+// Static files shared by all workers, each opened once. Lookups are
+// lock-free: the table is immutable and replaced when files are added,
+// change or are removed, old tables are freed through Rcu. A table is split
+// into shards shared with the previous one, an update only copies the
+// shards it modifies. Entries are reference counted so streams can keep
+// sending a replaced file.
+//
+// Changes are picked up by a thread reading inotify events, nothing is
+// polled. Watched directories are kept complete: created files are added
+// and deleted ones removed as soon as the kernel reports them.
+//
+// Compressible files requested by clients accepting br or gzip are
+// compressed in the background when there is no such variant on disk. The
+// result is kept in memory (a memfd) as another variant, dropped once the
+// file changes.
+//
+// Files are opened without reading them, their contents are hashed for the
+// entity tag in the background too and the entry replaced by one with it.
+class StaticFiles {
+public:
+  // files outside of these bounds aren't worth compressing, or too large to
+  // be compressed in memory
+  constexpr static size_t min_compress_size = 1024;
+  constexpr static size_t max_compress_size = 16 << 20;
+
+  StaticFiles(Rcu &rcu, bool compress);
+  ~StaticFiles();
+  StaticFiles(const StaticFiles &) = delete;
+  StaticFiles &operator=(const StaticFiles &) = delete;
+
+  // bumped by every change to the table
+  uint64_t generation() const {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+  // Variant of |relpath| preferred by |accept|, identity if none is
+  // acceptable. Called by workers.
+  std::shared_ptr<FileEntry> find(std::string_view relpath,
+                                  const AcceptEncoding &accept);
+
+  // URL of |relpath| with the fingerprint of its contents before the
+  // extension, e.g. /app.0123456789abcdef.js for /app.js. It changes with
+  // the contents, so responses to it never do. |relpath| if there is no
+  // such file or its contents aren't hashed (yet, or too large to be).
+  // Called by workers, like the two below.
+  std::string asset_url(std::string_view relpath);
+  // Variant preferred by |accept| of the version of the file an asset_url()
+  // refers to, null if |path| isn't one or the file changed since.
+  std::shared_ptr<FileEntry> resolve_asset(std::string_view path,
+                                           const AcceptEncoding &accept);
+  // JSON object mapping every hashed file to its asset_url()
+  std::string asset_manifest();
+
+  // Adds every file below |root|, keyed by their path after |root| with a
+  // leading '/', and keeps the table in sync with the directory tree.
+  std::vector<std::shared_ptr<FileEntry>> add_directory(std::string root);
+
+  // Opens |paths| and adds them in a single update, keyed by their path
+  // after the first |root_len| bytes. Files that can't be read are skipped.
+  // For files outside of watched directories. Thread safe.
+  std::vector<std::shared_ptr<FileEntry>>
+  add(std::vector<std::string> paths, size_t root_len, bool watch);
+
+private:
+  struct Table {
+    using Variants = std::vector<std::shared_ptr<FileEntry>>;
+    // variants of a file, plain and compressed. Keys point into one of the
+    // entries
+    using Files = std::unordered_map<std::string_view, Variants>;
+    constexpr static size_t num_shards = 256;
+
+    Table();
+    // shares the shards of |table|
+    Table(const Table &table);
+
+    static size_t shard_index(std::string_view relpath) {
+      return std::hash<std::string_view>{}(relpath) % num_shards;
+    }
+    const Files &shard(std::string_view relpath) const {
+      return *shards[shard_index(relpath)];
+    }
+    // the shard of |relpath|, copied first if shared with the previous table
+    Files &mutable_shard(std::string_view relpath);
+
+    // applies |fn| to the variants of |relpath|, dropping the variants
+    // compressed from a file no longer among them
+    void modify(std::string_view relpath,
+                const std::function<void(Variants &)> &fn);
+    void insert(std::shared_ptr<FileEntry> file);
+    // replaces |old| by |file| if it is still there, keeping the variants
+    // compressed from it
+    void replace(const FileEntry *old, std::shared_ptr<FileEntry> file);
+    void erase(std::string_view relpath, std::string_view path);
+    // erases the entry of |path| whichever variant it is
+    void erase_path(std::string_view path, size_t root_len);
+    void erase_below(std::string_view dir);
+
+    std::array<std::shared_ptr<Files>, num_shards> shards;
+    // shards copied by this table's update, the others are shared
+    std::array<bool, num_shards> owned = {};
+  };
+
+  // inotify watch of a directory or a single file
+  struct Watch {
+    std::string path;
+    size_t root_len;
+    bool dir;
+  };
+
+  // change to the table, files are opened before the update
+  struct Change {
+    enum { INSERT, ERASE, ERASE_BELOW } type;
+    std::string path;
+    size_t root_len;
+    std::shared_ptr<FileEntry> file;
+  };
+
+  // background work on a file: compressing it into a variant, or hashing
+  // its contents
+  struct Job {
+    enum { COMPRESS, HASH } type;
+    std::shared_ptr<FileEntry> file;
+    ContentEncoding encoding = ContentEncoding::IDENTITY;
+  };
+  // hashed files replaced in one update
+  constexpr static size_t hash_batch = 256;
+
+  // the file as read from disk, null if there are only compressed ones
+  static const FileEntry *identity(const Table::Variants &variants);
+  static std::string make_asset_url(std::string_view relpath,
+                                    std::string_view fingerprint);
+  // variant of |variants| preferred by |accept| among those |usable| allows,
+  // queues compressing the identity one if a better coding is acceptable
+  template <class Usable>
+  std::shared_ptr<FileEntry> select(const Table::Variants &variants,
+                                    const AcceptEncoding &accept,
+                                    Usable &&usable);
+
+  // copies the table, applies |fn| to the copy and publishes it. Shards |fn|
+  // doesn't modify are shared.
+  void update(const std::function<void(Table &)> &fn);
+
+  // watches |dir| and the directories below, appends the files to |files|.
+  // Called with watch_mutex_ held.
+  void watch_tree(const std::string &dir, size_t root_len,
+                  std::vector<std::string> &files);
+  // stops watching |dir| and everything below
+  void unwatch_tree(std::string_view dir);
+
+  void run();
+  // translates the events in |buf| into changes
+  void read_events(const char *buf, size_t len, std::vector<Change> &changes);
+  void resync(std::vector<Change> &changes);
+  void apply(std::vector<Change> &changes);
+
+  // queues compressing |source| if |accept| prefers a coding the server can
+  // produce over |served|
+  void request_variant(const std::shared_ptr<FileEntry> &source,
+                       ContentEncoding served, const AcceptEncoding &accept);
+  // queues hashing the contents of |files|, in shard order so a batch
+  // modifies few shards
+  void request_hashes(std::vector<std::shared_ptr<FileEntry>> files);
+  void background_loop();
+  void compress_file(Job &job);
+  void hash_files(std::vector<Job> &jobs);
+
+  Rcu &rcu_;
+  std::atomic<Table *> table_;
+  std::atomic<uint64_t> generation_ = 0;
+  // serialises updates
+  std::mutex update_mutex_;
+
+  int inotify_fd_;
+  // wakes the thread up to exit
+  int stop_fd_;
+  std::mutex watch_mutex_;
+  std::unordered_map<int, Watch> watches_;
+  // directories passed to add_directory()
+  std::vector<std::pair<std::string, size_t>> roots_;
+  std::thread thread_;
+
+  bool compress_;
+  std::mutex background_mutex_;
+  std::condition_variable background_cv_;
+  std::deque<Job> background_queue_;
+  bool background_stop_ = false;
+  std::thread background_thread_;
+};
+
+} // namespace hm
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string_view>
+#include <utility>
+
+#include "httprequest.h"
+#include "httprouter.h"
+
+namespace hm {
+
+// string literal usable as a template argument
+template <size_t N> struct RoutePath {
+  constexpr RoutePath(const char (&str)[N]) { std::copy_n(str, N, data); }
+  constexpr std::string_view view() const { return {data, N - 1}; }
+
+  char data[N];
+};
+
+// A route known at compile time. |Handler| is a function or a captureless
+// lambda taking (HttpRequest *, HttpResponse *), returning void or Task<>.
+template <HttpMethod Method, RoutePath Path, auto Handler> class Route {
+  template <class... Routes> friend class StaticRouter;
+
+  constexpr static auto handler = Handler;
+  constexpr static std::string_view path = Path.view();
+
+  static_assert(!path.empty() && path[0] == '/', "Route must start with '/'");
+
+  constexpr static size_t num_segments = [] {
+    size_t n = 0;
+    for (size_t pos = 1; pos < path.size();) {
+      auto end = std::min(path.find('/', pos), path.size());
+      n += end > pos;
+      pos = end + 1;
+    }
+    return n;
+  }();
+
+  constexpr static auto segments = [] {
+    std::array<RouteNodeData, num_segments> segments{};
+    size_t n = 0;
+    for (size_t pos = 1; pos < path.size();) {
+      auto end = std::min(path.find('/', pos), path.size());
+      if (end > pos) {
+        segments[n++] = parse_route_segment(path.substr(pos, end - pos));
+      }
+      pos = end + 1;
+    }
+    return segments;
+  }();
+
+  constexpr static size_t num_params =
+      std::count_if(segments.begin(), segments.end(), is_route_param);
+
+  static_assert(num_params <= RouteParams::max_params,
+                "Too many parameters in route");
+  static_assert(
+      [] {
+        for (size_t i = 0; i + 1 < num_segments; i++) {
+          if (segments[i].type == RouteNodeData::Type::CATCH_ALL) {
+            return false;
+          }
+        }
+        return true;
+      }(),
+      "Catch-all must be the last segment of a route");
+
+  // labels of the parameters, in capture order
+  constexpr static auto labels = [] {
+    std::array<RouteNodeData, num_params> labels{};
+    std::copy_if(segments.begin(), segments.end(), labels.begin(),
+                 is_route_param);
+    return labels;
+  }();
+
+  // regexes can't be compiled at compile time, a route silently never
+  // matching is worse than not starting
+  static void validate() {
+    for (auto &data : segments) {
+      if (data.type == RouteNodeData::Type::PARAM_REGEX &&
+          !RegexDfa::compile(data.pattern)) {
+        std::cerr << "Invalid route pattern: " << data.pattern
+                  << " in route: " << path << std::endl;
+        std::abort();
+      }
+    }
+  }
+
+  // matches the segment I of the route against the one at |pos| in |path|
+  template <size_t I>
+  static bool match_segment(std::string_view path, size_t &pos,
+                            RouteParams &params) {
+    using enum RouteNodeData::Type;
+    constexpr auto data = segments[I];
+    constexpr auto param_index = std::count_if(
+        segments.begin(), segments.begin() + I, is_route_param);
+
+    if (pos + 1 >= path.size()) {
+      return false;
+    }
+    auto end = std::min(path.find('/', pos + 1), path.size());
+    auto segment = path.substr(pos + 1, end - pos - 1);
+
+    if constexpr (data.type == CONSTANT) {
+      if (segment != data.label) {
+        return false;
+      }
+    } else if constexpr (data.type == WILDCARD) {
+      if (segment.empty()) {
+        return false;
+      }
+    } else if constexpr (data.type == CATCH_ALL) {
+      params.params[param_index].value = path.substr(pos + 1);
+      pos = path.size();
+      return true;
+    } else if constexpr (data.type == PARAM_REGEX) {
+      // checked by validate()
+      static const auto regex = RegexDfa::compile(data.pattern);
+      if (segment.empty() || !regex->match(segment)) {
+        return false;
+      }
+      params.params[param_index].value = segment;
+    } else {
+      if (!match_param(data.type, segment, params.params[param_index])) {
+        return false;
+      }
+    }
+    pos = end;
+    return true;
+  }
+
+  static bool match(HttpMethod method, std::string_view path,
+                    RouteParams &params) {
+    if (method != Method) {
+      return false;
+    }
+    size_t pos = 0;
+    bool matched = [&]<size_t... I>(std::index_sequence<I...>) {
+      return (match_segment<I>(path, pos, params) && ...);
+    }(std::make_index_sequence<num_segments>{});
+    // whole path consumed ("" or "/")
+    if (!matched || pos + 1 < path.size()) {
+      return false;
+    }
+    params.count = num_params;
+    return true;
+  }
+};
+
+template <RoutePath Path, auto Handler>
+using Get = Route<HttpMethod::GET, Path, Handler>;
+template <RoutePath Path, auto Handler>
+using Post = Route<HttpMethod::POST, Path, Handler>;
+
+// Router over a fixed set of routes. Matching code is generated for every
+// route and handlers are called directly, so they can be inlined. Routes
+// are tried in the order they are listed, the first match wins.
+//
+//   using Routes = StaticRouter<Get<"/users/{id:int}", get_user>,
+//                               Post<"/users", create_user>>;
+//   server.use_routes<Routes>();
+template <class... Routes> class StaticRouter {
+public:
+  // aborts if a route has an invalid {label:<regex>} segment, called by
+  // Server::use_routes()
+  static void validate() { (Routes::validate(), ...); }
+
+  static bool dispatch_route(HttpMethod method, std::string_view path,
+                             HttpRequest *request, HttpResponse *response) {
+    if (path.empty() || path[0] != '/') {
+      return false;
+    }
+    return (try_route<Routes>(method, path, request, response) || ...);
+  }
+
+private:
+  template <class R>
+  static bool try_route(HttpMethod method, std::string_view path,
+                        HttpRequest *request, HttpResponse *response) {
+    if (!R::match(method, path, request->params_)) {
+      return false;
+    }
+    request->param_labels_ = R::labels;
+    if constexpr (CoroFunc<decltype(R::handler)>) {
+      request->start_handler(R::handler(request, response));
+    } else {
+      R::handler(request, response);
+    }
+    return true;
+  }
+};
+
+} // namespace hm
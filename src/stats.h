@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+namespace hm {
+
+// counter written only by the owning worker thread, readable from any thread
+class Counter {
+public:
+  void inc(uint64_t n = 1) {
+    value_.store(value_.load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+  }
+
+  uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value_ = 0;
+};
+
+// per worker counters
+struct Stats {
+  // streams and frames that exhausted their rate limit, each calms the
+  // session (see h2_sessions_calmed)
+  Counter h2_stream_flood;
+  Counter h2_rst_stream_flood;
+  Counter h2_settings_flood;
+  Counter h2_ping_flood;
+  Counter h2_empty_frame_flood;
+  // sessions terminated with ENHANCE_YOUR_CALM
+  Counter h2_sessions_calmed;
+  // allocations made by nghttp2 through the worker's pool, and those too
+  // large for its size classes
+  Counter h2_mem_allocs;
+  Counter h2_mem_large_allocs;
+  // lookups of cached routes: fresh and stale responses served, misses that
+  // ran the handler and misses that waited for another one's response
+  Counter response_cache_hits;
+  Counter response_cache_stale_hits;
+  Counter response_cache_misses;
+  Counter response_cache_collapsed;
+  // static files sent from and not found in the FileCache
+  Counter file_cache_hits;
+  Counter file_cache_misses;
+  // file lookups answered by the negative cache, and the access() calls
+  // they avoided
+  Counter static_negative_hits;
+  Counter static_syscalls_saved;
+  // file reads that would have blocked and ran on the worker's IoPool
+  Counter file_reads_offloaded;
+
+  // calls fn(name, value) for every counter
+  void visit(auto &&fn) const {
+    fn("h2_stream_flood", h2_stream_flood.get());
+    fn("h2_rst_stream_flood", h2_rst_stream_flood.get());
+    fn("h2_settings_flood", h2_settings_flood.get());
+    fn("h2_ping_flood", h2_ping_flood.get());
+    fn("h2_empty_frame_flood", h2_empty_frame_flood.get());
+    fn("h2_sessions_calmed", h2_sessions_calmed.get());
+    fn("h2_mem_allocs", h2_mem_allocs.get());
+    fn("h2_mem_large_allocs", h2_mem_large_allocs.get());
+    fn("response_cache_hits", response_cache_hits.get());
+    fn("response_cache_stale_hits", response_cache_stale_hits.get());
+    fn("response_cache_misses", response_cache_misses.get());
+    fn("response_cache_collapsed", response_cache_collapsed.get());
+    fn("file_cache_hits", file_cache_hits.get());
+    fn("file_cache_misses", file_cache_misses.get());
+    fn("static_negative_hits", static_negative_hits.get());
+    fn("static_syscalls_saved", static_syscalls_saved.get());
+    fn("file_reads_offloaded", file_reads_offloaded.get());
+  }
+};
+
+} // namespace hm
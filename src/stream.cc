@@ -1,3 +1,4 @@
+#include <cstring>
 #include <ev.h>
 
 #include <iostream>
@@ -17,119 +18,115 @@
 namespace hm {
 
 Stream::Stream(HttpSession *session, int32_t stream_id)
-    : headers{}, session_(session), request_(this), response_(this),
-      id_(stream_id) {
+    : headers(arena_), response_headers(arena_), session_(session),
+      request_(this), response_(this), id_(stream_id) {
   ev_timer_init(&rtimer_, timeout_cb, 0., 30.);
   ev_timer_init(&wtimer_, timeout_cb, 0., 30.);
   rtimer_.data = this;
   wtimer_.data = this;
-  session_->worker_->add_stream(this);
+  serial_ = session_->worker_->streams_.handle(this);
 }
 
 Stream::~Stream() {
-  session_->worker_->remove_stream(this);
+  if (cache_) {
+    cache_->abort(this);
+  }
   ev_timer_stop(session_->loop_, &rtimer_);
   ev_timer_stop(session_->loop_, &wtimer_);
 }
 
-Stream::Headers::RCBuf::RCBuf() {
-  scheme = authority = host = path = expect = ims = nullptr;
-  nvlen = 0;
+Stream::Headers::RCBuf::RCBuf(Arena &arena)
+    : additional(ArenaAllocator<rcbuf_pair>(arena)) {
+  known.fill(nullptr);
 }
 
 Stream::Headers::RCBuf::~RCBuf() {
-  if (scheme) {
-    nghttp2_rcbuf_decref(scheme);
-  }
-  if (authority) {
-    nghttp2_rcbuf_decref(authority);
-  }
-  if (host) {
-    nghttp2_rcbuf_decref(host);
+  for (auto value : known) {
+    if (value) {
+      nghttp2_rcbuf_decref(value);
+    }
   }
-  if (path) {
-    nghttp2_rcbuf_decref(path);
+  for (auto [name, value] : additional) {
+    nghttp2_rcbuf_decref(name);
+    nghttp2_rcbuf_decref(value);
   }
-  if (expect) {
-    nghttp2_rcbuf_decref(expect);
+}
+
+std::optional<std::string_view>
+Stream::Headers::get_header(std::string_view header_name) {
+  auto header = util::lookup_header(header_name);
+  if (header != HttpHeader::eNOTFOUND) {
+    return get(header);
   }
-  if (ims) {
-    nghttp2_rcbuf_decref(ims);
+  for (auto [name, value] : rcbuf.additional) {
+    if (util::streq_l(header_name, util::to_string_view(name))) {
+      return util::to_string_view(value);
+    }
   }
-  for (int i = 0; i < nvlen; i++) {
-    nghttp2_rcbuf_decref(nva[i].first);
-    nghttp2_rcbuf_decref(nva[i].second);
+  return std::nullopt;
+}
+
+std::optional<std::string_view>
+Stream::Headers::get_cookie(std::string_view name) {
+  if (!cookies_parsed_) {
+    parse_cookies();
   }
-  if (nvlen == max_nva_len) {
-    for (int i = 0; i < additional.size(); i++) {
-      nghttp2_rcbuf_decref(additional[i].first);
-      nghttp2_rcbuf_decref(additional[i].second);
+  for (auto [key, value] : cookies_) {
+    if (key == name) {
+      return value;
     }
   }
+  return std::nullopt;
 }
 
-std::optional<std::string_view>
-Stream::Headers::get_header(std::string_view header_name) {
-  auto header_t = util::lookup_header(header_name);
-  if (util::streq_l(header_name, "expect")) {
-    return expect();
-  } else if (util::streq_l(header_name, "if-modified-since")) {
-    return ims();
-  } else {
-    for (int i = 0; i < rcbuf.nvlen; i++) {
-      if (util::streq_l(header_name,
-                        get_string_view(rcbuf.nva[i].first).value())) {
-        return get_string_view(rcbuf.nva[i].second);
+void Stream::Headers::parse_cookies() {
+  cookies_parsed_ = true;
+
+  auto parse = [this](std::string_view cookie) {
+    // name=value pairs separated by "; ", HTTP/2 clients may also split
+    // them across several cookie headers
+    while (!cookie.empty()) {
+      auto end = cookie.find(';');
+      auto pair = cookie.substr(0, end);
+      cookie = end == cookie.npos ? "" : cookie.substr(end + 1);
+
+      auto beg = pair.find_first_not_of(" \t");
+      if (beg == pair.npos) {
+        continue;
       }
-    }
-    if (rcbuf.nvlen == max_nva_len) {
-      for (int i = 0; i < rcbuf.additional.size(); i++) {
-        if (util::streq_l(header_name,
-                          get_string_view(rcbuf.additional[i].first).value())) {
-          return get_string_view(rcbuf.additional[i].second);
-        }
+      pair = pair.substr(beg, pair.find_last_not_of(" \t") - beg + 1);
+
+      auto eq = pair.find('=');
+      if (eq == pair.npos || eq == 0) {
+        continue;
       }
+      cookies_.emplace_back(pair.substr(0, eq), pair.substr(eq + 1));
+    }
+  };
+
+  if (auto cookie = get(HttpHeader::COOKIE)) {
+    parse(*cookie);
+  }
+  for (auto [name, value] : rcbuf.additional) {
+    if (util::lookup_header(util::to_string_view(name)) ==
+        HttpHeader::COOKIE) {
+      parse(util::to_string_view(value));
     }
   }
-  return std::nullopt;
 }
 
-void Stream::Headers::add_header(nghttp2_rcbuf *name, nghttp2_rcbuf *value) {
-  auto namebuf = nghttp2_rcbuf_get_buf(name);
-  auto header_t = util::lookup_header(namebuf.base, namebuf.len);
+void Stream::Headers::add_header(HttpHeader header, nghttp2_rcbuf *name,
+                                 nghttp2_rcbuf *value) {
+  if (header == HttpHeader::pMETHOD) {
+    method = hm::method_from_string(util::to_string_view(value));
+  }
 
   nghttp2_rcbuf_incref(value);
-  switch (header_t) {
-  case util::HttpHeader::pMETHOD:
-    method = hm::method_from_string(get_string_view(value).value());
-    nghttp2_rcbuf_decref(value);
-    break;
-  case util::HttpHeader::pSCHEME:
-    rcbuf.scheme = value;
-    break;
-  case util::HttpHeader::pAUTHORITY:
-    rcbuf.authority = value;
-    break;
-  case util::HttpHeader::pHOST:
-    rcbuf.host = value;
-    break;
-  case util::HttpHeader::pPATH:
-    rcbuf.path = value;
-    break;
-  case util::HttpHeader::EXPECT:
-    rcbuf.expect = value;
-    break;
-  case util::HttpHeader::IF_MODIFIED_SINCE:
-    rcbuf.ims = value;
-    break;
-  default:
+  if (header != HttpHeader::eNOTFOUND && !rcbuf.known[(size_t)header]) {
+    rcbuf.known[(size_t)header] = value;
+  } else {
     nghttp2_rcbuf_incref(name);
-    if (rcbuf.nvlen < max_nva_len) {
-      rcbuf.nva[rcbuf.nvlen++] = {name, value};
-    } else {
-      rcbuf.additional.emplace_back(name, value);
-    }
-    break;
+    rcbuf.additional.emplace_back(name, value);
   }
 }
 
@@ -143,14 +140,15 @@ UUIDGenerator *Stream::get_uuid_generator() {
   return session_->worker_->get_uuid_generator();
 }
 
-FileEntry *Stream::get_static_file(const std::string_view &rel_path,
-                                   bool prefer_compressed, bool relative,
-                                   bool watch) {
-  return session_->worker_->get_static_file(rel_path, prefer_compressed,
-                                            relative, watch);
+std::shared_ptr<FileEntry>
+Stream::get_static_file(const std::string_view &rel_path,
+                        const AcceptEncoding &accept, bool relative,
+                        bool watch) {
+  return session_->worker_->get_static_file(rel_path, accept, relative,
+                                            watch);
 }
 
-Buffer<64 * 1024> *Stream::get_buffer() { return &session_->wbuf_; }
+WriteBuffer *Stream::get_buffer() { return session_->wbuf_; }
 
 void Stream::reset_read_timeout() { ev_timer_again(session_->loop_, &rtimer_); }
 
@@ -202,6 +200,10 @@ int Stream::submit_response(DataStream *data_stream) {
   if (response_headers.status == nullptr) {
     response_headers.status = "200";
   }
+  if (cache_) {
+    // not a cacheable response
+    cache_->abort(this);
+  }
 
   response_headers.set_status();
 
@@ -222,6 +224,9 @@ int Stream::submit_response(DataStream *data_stream) {
 }
 
 int Stream::submit_rst(uint32_t error_code) {
+  if (cache_) {
+    cache_->abort(this);
+  }
   stop_read_timeout();
   stop_write_timeout();
 
@@ -240,90 +245,263 @@ int Stream::submit_non_final_response(std::string_view status) {
   return rv;
 }
 
-int Stream::submit_string_response(std::string &&response) {
-  auto ss = add_data_stream<StringStream>(std::move(response));
+int Stream::submit_string_stream(StringStream *ss, const char *content_type) {
+  if (content_type) {
+    response_headers.set_header_nc("content-type", content_type);
+  }
 
+  if (cache_) {
+    if (!is_shareable_response()) {
+      cache_->abort(this);
+    } else {
+      auto [nva, nvlen] = response_headers.get_buffer();
+      CachedResponse response{.status = "200"};
+      for (size_t i = reserved_response_headers_len; i < nvlen; i++) {
+        response.headers.emplace_back(
+            std::string((const char *)nva[i].name, nva[i].namelen),
+            std::string((const char *)nva[i].value, nva[i].valuelen));
+      }
+      response.body = std::make_shared<const std::string>(ss->view());
+      cache_->fill(this, std::move(response));
+    }
+  }
+
+  if (auto cs = compress_body(ss, content_type)) {
+    return submit_response(cs);
+  }
   response_headers.set_header_nc("content-length",
-                                 util::to_string(ss->length(), mem_block_));
+                                 util::to_string(ss->length(), arena_));
 
   return submit_response(ss);
 }
 
-int Stream::submit_html_response(std::string &&response) {
-
-  auto ss = add_data_stream<StringStream>(std::move(response));
+bool Stream::is_shareable_response() {
+  if (response_headers.status && strcmp(response_headers.status, "200")) {
+    return false;
+  }
+  auto [nva, nvlen] = response_headers.get_buffer();
+  for (size_t i = reserved_response_headers_len; i < nvlen; i++) {
+    std::string_view name((const char *)nva[i].name, nva[i].namelen);
+    std::string_view value((const char *)nva[i].value, nva[i].valuelen);
+    // per user, replaying it would hand one client's session to others
+    if (util::streq_l(name, "set-cookie")) {
+      return false;
+    }
+    if (util::streq_l(name, "cache-control") &&
+        (value.find("private") != value.npos ||
+         value.find("no-store") != value.npos)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  response_headers.set_header_nc("content-type", "text/html; charset=utf-8");
-  response_headers.set_header_nc("content-length",
-                                 util::to_string(ss->length(), mem_block_));
+DataStream *Stream::compress_body(StringStream *ss, const char *content_type) {
+  auto server = session_->get_server();
+  auto &policy = request_.compress_policy_ ? *request_.compress_policy_
+                                           : server->config_.compression;
+  if (!policy.enabled || ss->length() < policy.min_size || !content_type ||
+      !is_compressible(content_type)) {
+    return nullptr;
+  }
+  // whether compressed or not depends on accept-encoding
+  response_headers.set_header_nc("vary", "accept-encoding");
+
+  auto accept =
+      AcceptEncoding::parse(headers.get(util::HttpHeader::ACCEPT_ENCODING));
+  auto encoding = accept.prefers(ContentEncoding::BR, ContentEncoding::GZIP)
+                      ? ContentEncoding::BR
+                      : ContentEncoding::GZIP;
+  if (!accept.accepts(encoding) ||
+      !accept.prefers(encoding, ContentEncoding::IDENTITY)) {
+    return nullptr;
+  }
 
-  return submit_response(ss);
+  auto pool = session_->worker_->get_compressor_pool();
+  auto compressor = pool->get(encoding, encoding == ContentEncoding::BR
+                                            ? policy.br_level
+                                            : policy.gzip_level);
+  if (!compressor) {
+    return nullptr;
+  }
+  // no content-length, the end of the stream ends the body
+  response_headers.set_header_nc("content-encoding", encoding_name(encoding));
+  data_stream_ = &compress_stream_.emplace(ss, std::move(*compressor), pool);
+  return data_stream_;
 }
 
-int Stream::submit_json_response(std::string &&response) {
-
+int Stream::submit_string_response(std::string &&response) {
   auto ss = add_data_stream<StringStream>(std::move(response));
+  return submit_string_stream(ss, nullptr);
+}
 
-  response_headers.set_header_nc("content-type", "application/json");
-  response_headers.set_header_nc("content-length",
-                                 util::to_string(ss->length(), mem_block_));
+int Stream::submit_html_response(std::string &&response) {
+  auto ss = add_data_stream<StringStream>(std::move(response));
+  return submit_string_stream(ss, "text/html; charset=utf-8");
+}
 
-  return submit_response(ss);
+int Stream::submit_json_response(std::string &&response) {
+  auto ss = add_data_stream<StringStream>(std::move(response));
+  return submit_string_stream(ss, "application/json");
 }
 
 int Stream::submit_json_response(db::ResultString &&response) {
   auto ss = add_data_stream<StringStream>(std::move(response));
+  return submit_string_stream(ss, "application/json");
+}
+
+int Stream::submit_view_response(std::string_view response,
+                                 const char *content_type) {
+  auto ss = add_data_stream<StringStream>(response);
+  return submit_string_stream(ss, content_type);
+}
 
-  response_headers.set_header_nc("content-type", "application/json");
+int Stream::submit_cached_response(const CachedResponse &response) {
+  auto ss = add_data_stream<StringStream>(response.body);
+
+  response_headers.status = arena_.copy(response.status).data();
+  for (auto &[name, value] : response.headers) {
+    response_headers.set_header_nc(arena_.copy(name).data(),
+                                   arena_.copy(value));
+  }
   response_headers.set_header_nc("content-length",
-                                 util::to_string(ss->length(), mem_block_));
+                                 util::to_string(ss->length(), arena_));
 
   return submit_response(ss);
 }
 
 int Stream::submit_file_response(std::string_view path, bool prefer_compressed,
-                                 bool relative, bool watch) {
+                                 bool relative, bool watch, bool immutable) {
+
+  auto accept = prefer_compressed
+                    ? AcceptEncoding::parse(
+                          headers.get(util::HttpHeader::ACCEPT_ENCODING))
+                    : AcceptEncoding();
+  auto file = get_static_file(path, accept, relative, watch);
+  if (!file) {
+    response_headers.status = "404";
+    submit_json_response("<html><h1>404</h1><p>Content not found.</p></html>");
+    return -1;
+  }
+  return submit_file_response(std::move(file), path, prefer_compressed,
+                              immutable);
+}
 
-  auto file = get_static_file(path, prefer_compressed, relative, watch);
+int Stream::submit_file_response(std::shared_ptr<FileEntry> file,
+                                 std::string_view path, bool prefer_compressed,
+                                 bool immutable) {
+  // header values are the file's own, sent without copying
+  static_file_ = file;
+  auto length = file->info().length;
+  auto date = session_->get_cached_date();
+
+  // a 304 carries the cache-control and vary the 200 would have, so
+  // caches refreshing their copy keep treating it the same
+  bool vary = prefer_compressed && (file->compressed() || file->compressible());
+  std::string_view cache_control =
+      immutable ? "public, max-age=31536000, immutable"
+                : session_->get_server()->static_cache_control(path);
+
+  if (not_modified(*file)) {
+    if (vary) {
+      response_headers.set_header_nc("vary", "accept-encoding");
+    }
+    response_headers.set_header_nc("cache-control", cache_control);
+    response_headers.set_header_nc("date", date);
+    response_headers.set_header_nc("etag", file->etag());
+    response_headers.status = "304";
+    return submit_response(nullptr);
+  }
 
-  if (file) {
+  auto ranges = requested_ranges(*file);
+  if (ranges && ranges->empty()) {
+    response_headers.status = "416";
+    response_headers.set_header_nc(
+        "content-range", arena_.copy("bytes */" + std::to_string(length)));
+    response_headers.set_header_nc("date", date);
+    return submit_response(nullptr);
+  }
 
-    time_t last_mod = 0;
-    bool last_mod_found = false;
-    if (headers.ims()) {
-      /* nghttp2 rcbuf is value is guaranteed to be null terminated */
-      last_mod = util::parse_http_date(headers.ims().value().data());
-      last_mod_found = true;
-    }
+  response_headers.set_header_nc("accept-ranges", "bytes");
+  if (file->compressed()) {
+    response_headers.set_header_nc("content-encoding",
+                                   encoding_name(file->encoding()));
+  }
+  if (vary) {
+    // the variant depends on accept-encoding
+    response_headers.set_header_nc("vary", "accept-encoding");
+  }
+  response_headers.set_header_nc("cache-control", cache_control);
+  response_headers.set_header_nc("date", date);
+  response_headers.set_header_nc("last-modified", file->last_modified());
+  response_headers.set_header_nc("etag", file->etag());
+
+  if (ranges && ranges->size() == 1) {
+    auto [offset, range_length] = ranges->front();
+    response_headers.status = "206";
+    response_headers.set_header_nc("content-type", file->mime_type());
+    response_headers.set_header_nc(
+        "content-range",
+        arena_.copy("bytes " + std::to_string(offset) + "-" +
+                    std::to_string(offset + range_length - 1) + "/" +
+                    std::to_string(length)));
+    response_headers.set_header_nc("content-length",
+                                   util::to_string(range_length, arena_));
+    return submit_response(
+        add_data_stream<FileStream>(file, this, offset, range_length));
+  }
+  if (ranges) {
+    auto boundary = uuids::to_string(
+        Worker::get_worker()->get_uuid_generator()->generate());
+    auto bs = add_data_stream<ByteRangesStream>(file, this, *ranges,
+                                                std::move(boundary));
+    response_headers.status = "206";
+    response_headers.set_header_nc("content-type",
+                                   arena_.copy(bs->content_type()));
+    response_headers.set_header_nc("content-length",
+                                   util::to_string(bs->length(), arena_));
+    return submit_response(bs);
+  }
 
-    auto fs = add_data_stream<FileStream>(file);
+  response_headers.set_header_nc("content-type", file->mime_type());
+  response_headers.set_header_nc("content-length", file->content_length());
+  // hot small files are sent from memory
+  if (auto contents = session_->get_server()->file_cache_.get(file)) {
+    return submit_response(add_data_stream<StringStream>(std::move(contents)));
+  }
+  return submit_response(add_data_stream<FileStream>(file, this));
+}
 
-    auto [mtime, length] = file->info();
-    auto date = session_->get_cached_date();
+bool Stream::not_modified(const FileEntry &file) {
+  // If-None-Match takes precedence
+  if (auto inm = headers.get(util::HttpHeader::IF_NONE_MATCH)) {
+    return util::etag_matches(*inm, file.etag());
+  }
+  if (auto ims = headers.ims()) {
+    // clients mostly send back the last-modified they got, no need to parse
+    // it then. nghttp2 rcbuf values are null terminated
+    return *ims == file.last_modified() ||
+           file.info().mtime <= util::parse_http_date(ims->data());
+  }
+  return false;
+}
 
-    if (last_mod_found && mtime <= last_mod) {
-      response_headers.set_header_nc("date", date);
-      response_headers.status = "304";
-      return submit_response(nullptr);
-    } else {
-      response_headers.set_header_nc("content-type", file->mime_type());
-      response_headers.set_header_nc("content-length",
-                                     util::to_string(length, mem_block_));
-      if (file->compressed()) {
-        response_headers.set_header_nc("content-encoding", file->encoding());
-      }
-      /* for development, files might change */
-      response_headers.set_header_nc("cache-control", "max-age=0");
-      response_headers.set_header_nc("date", date);
-      response_headers.set_header_nc("last-modified",
-                                     util::http_date(mtime, mem_block_));
-      return submit_response(fs);
+std::optional<std::vector<util::ByteRange>>
+Stream::requested_ranges(const FileEntry &file) {
+  auto range = headers.get(util::HttpHeader::RANGE);
+  if (headers.method != HttpMethod::GET || !range) {
+    return std::nullopt;
+  }
+  if (auto if_range = headers.get(util::HttpHeader::IF_RANGE)) {
+    // ranges only apply to the file the client already has part of, strong
+    // comparison of entity tags
+    bool is_etag = if_range->starts_with('"') || if_range->starts_with("W/");
+    if (is_etag ? *if_range != file.etag()
+                : *if_range != file.last_modified()) {
+      return std::nullopt;
     }
-  } else {
-    response_headers.status = "404";
-    submit_json_response("<html><h1>404</h1><p>Content not found.</p></html>");
   }
-  return -1;
+  return util::parse_range(*range, file.info().length, max_byte_ranges);
 }
 
 int Stream::submit_file_response() {
@@ -351,27 +529,49 @@ void Stream::parse_path() {
 
   path_ = (raw_path.find('%') == raw_path.npos)
               ? raw_path
-              : util::percent_decode(raw_path, mem_block_);
+              : util::percent_decode(raw_path, arena_);
   query_ = (raw_query.find('%') == raw_query.npos)
                ? raw_query
-               : util::percent_decode(raw_query, mem_block_);
+               : util::percent_decode(raw_query, arena_);
 }
 
 int Stream::prepare_response() {
 
   // TODO: Implement push promise
 
-  // TODO: Use Accept-Encoding to determine if compression is preferred
-
-  // TODO: Don't do handler lookup for obvious file request and vice versa
-
-  if (session_->get_server()->router_.dispatch_route(headers.method, path_,
-                                                     &request_, &response_)) {
+  auto server = session_->get_server();
+  if (server->static_dispatch_ &&
+      server->static_dispatch_(headers.method, path_, &request_, &response_)) {
     return 0;
   }
-  // unhandled, might be a file request
-  if (headers.method == HttpMethod::GET) {
+  switch (server->router_.dispatch_route(headers.method, path_, &request_,
+                                         &response_)) {
+  case RouteMatch::HANDLER:
+    return 0;
+  case RouteMatch::STATIC_FILE:
+    return submit_file_response();
+  case RouteMatch::NOT_FOUND:
+    break;
+  }
+  if (headers.method == HttpMethod::GET &&
+      server->static_files_->find(path_, AcceptEncoding())) {
+    // created after the routes were compiled
     return submit_file_response();
+  }
+  if (headers.method == HttpMethod::GET && server->config_.fingerprint_assets) {
+    if (path_ == server->config_.asset_manifest_path) {
+      response_headers.set_header_nc("cache-control", "no-cache");
+      return submit_json_response(server->static_files_->asset_manifest());
+    }
+    auto accept = AcceptEncoding::parse(
+        headers.get(util::HttpHeader::ACCEPT_ENCODING));
+    if (auto file = server->static_files_->resolve_asset(path_, accept)) {
+      return submit_file_response(std::move(file), path_, true, true);
+    }
+  }
+  if (headers.method == HttpMethod::GET) {
+    response_headers.status = "404";
+    submit_json_response("<html><h1>404</h1><p>Content not found.</p></html>");
   } else {
     response_headers.status = "400";
     submit_json_response("<html><h1>400</h1><p>Bad Request.</p></html>");
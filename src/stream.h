@@ -12,7 +12,11 @@
 #include <ev.h>
 #include <nghttp2/nghttp2.h>
 
+#include "arena.h"
 #include "buffer.h"
+#include "bufferpool.h"
+#include "byterangesstream.h"
+#include "compressstream.h"
 #include "datastream.h"
 #include "dbresult.h"
 #include "dbsession.h"
@@ -21,6 +25,7 @@
 #include "httprequest.h"
 #include "httpresponse.h"
 #include "httprouter.h"
+#include "responsecache.h"
 #include "stringstream.h"
 #include "util.h"
 
@@ -38,6 +43,11 @@ class Stream {
   friend class EventStream;
   friend class HttpRequest;
   friend class HttpRouter;
+  friend class ResponseCache;
+
+  // request scoped memory, freed in one go with the stream. Declared first
+  // so the members below can allocate from it
+  Arena arena_;
 
 public:
   using string_view_pair = std::pair<std::string_view, std::string_view>;
@@ -49,10 +59,12 @@ public:
   uint64_t serial() { return serial_; }
 
   HttpSession *get_session();
+  Arena *get_arena() { return &arena_; }
   db::Session *get_db_session();
   UUIDGenerator *get_uuid_generator();
 
-  Buffer<64 * 1024> *get_buffer();
+  // session write buffer, only valid while DataStream::send() is called
+  WriteBuffer *get_buffer();
   // resets read timeout
   void reset_read_timeout();
   // resets write timeout
@@ -77,8 +89,9 @@ public:
     return &ds;
   }
 
-  FileEntry *get_static_file(const std::string_view &rel_path,
-                             bool prefer_compressed, bool relative, bool watch);
+  std::shared_ptr<FileEntry> get_static_file(const std::string_view &rel_path,
+                                             const AcceptEncoding &accept,
+                                             bool relative, bool watch);
 
   void parse_path();
 
@@ -96,9 +109,19 @@ public:
 
   int submit_json_response(std::string &&response);
   int submit_json_response(db::ResultString &&response);
+  // |response| must live as long as the stream, e.g. allocated from arena_
+  int submit_view_response(std::string_view response,
+                           const char *content_type = nullptr);
+  int submit_cached_response(const CachedResponse &response);
 
+  // |immutable| for asset URLs (see Server::asset_url()), cached for good
   int submit_file_response(std::string_view path, bool prefer_compressed = true,
-                           bool relative = true, bool watch = true);
+                           bool relative = true, bool watch = true,
+                           bool immutable = false);
+  // sends |file| found at |path|
+  int submit_file_response(std::shared_ptr<FileEntry> file,
+                           std::string_view path, bool prefer_compressed,
+                           bool immutable);
   int submit_file_response();
 
   /* void prepare_status_response(...) */
@@ -106,6 +129,7 @@ public:
   int prepare_response();
 
   struct Headers {
+    using HttpHeader = util::HttpHeader;
 
   private:
     std::optional<std::string_view> get_string_view(nghttp2_rcbuf *rcbuf) {
@@ -116,49 +140,55 @@ public:
     }
 
   public:
+    Headers(Arena &arena)
+        : method{}, rcbuf(arena),
+          cookies_(ArenaAllocator<string_view_pair>(arena)) {}
+
     std::optional<std::string_view> scheme() {
-      return get_string_view(rcbuf.scheme);
+      return get(HttpHeader::pSCHEME);
     }
     std::optional<std::string_view> authority() {
-      return get_string_view(rcbuf.authority);
-    }
-    std::optional<std::string_view> host() {
-      return get_string_view(rcbuf.host);
-    }
-    std::optional<std::string_view> path() {
-      return get_string_view(rcbuf.path);
+      return get(HttpHeader::pAUTHORITY);
     }
+    std::optional<std::string_view> host() { return get(HttpHeader::HOST); }
+    std::optional<std::string_view> path() { return get(HttpHeader::pPATH); }
     std::optional<std::string_view> ims() {
-      return get_string_view(rcbuf.ims /* */);
+      return get(HttpHeader::IF_MODIFIED_SINCE);
     }
     std::optional<std::string_view> expect() {
-      return get_string_view(rcbuf.expect);
+      return get(HttpHeader::EXPECT);
     }
 
-    inline constexpr static uint32_t max_nva_len = 10;
-
     HttpMethod method;
     struct RCBuf {
       using rcbuf_pair = std::pair<nghttp2_rcbuf *, nghttp2_rcbuf *>;
-      nghttp2_rcbuf *scheme;
-      nghttp2_rcbuf *authority;
-      nghttp2_rcbuf *host;
-      nghttp2_rcbuf *path;
-      nghttp2_rcbuf *expect;
-      nghttp2_rcbuf *ims;
-      std::array<rcbuf_pair, max_nva_len> nva;
-      size_t nvlen;
-      std::vector<rcbuf_pair> additional;
-
-      RCBuf();
+      // first value of every known header, indexed by HttpHeader
+      std::array<nghttp2_rcbuf *, util::num_known_headers> known;
+      // unknown headers, and repeated known ones after the first
+      std::vector<rcbuf_pair, ArenaAllocator<rcbuf_pair>> additional;
+
+      RCBuf(Arena &arena);
       ~RCBuf();
     } rcbuf;
 
     size_t buffer_size = 0;
 
+    // first value of a known header
+    std::optional<std::string_view> get(HttpHeader header) {
+      return get_string_view(rcbuf.known[(size_t)header]);
+    }
     std::optional<std::string_view> get_header(std::string_view header_name);
-    void add_header(nghttp2_rcbuf *name, nghttp2_rcbuf *value);
+    // cookie headers are parsed on the first call
+    std::optional<std::string_view> get_cookie(std::string_view name);
+    // |header| is the token of |name|, as returned by util::lookup_header()
+    void add_header(HttpHeader header, nghttp2_rcbuf *name,
+                    nghttp2_rcbuf *value);
+
+  private:
+    void parse_cookies();
 
+    std::vector<string_view_pair, ArenaAllocator<string_view_pair>> cookies_;
+    bool cookies_parsed_ = false;
   } headers;
 
   constexpr static size_t reserved_response_headers_len = 1;
@@ -167,7 +197,7 @@ public:
     const char *status;
     inline constexpr static uint32_t max_nva_len = 10;
     std::array<nghttp2_nv, max_nva_len> nva;
-    std::vector<nghttp2_nv> nvector;
+    std::vector<nghttp2_nv, ArenaAllocator<nghttp2_nv>> nvector;
 
     size_t nvlen = reserved_response_headers_len;
     // std::vector<nghttp2_nv> additional;
@@ -215,11 +245,30 @@ public:
       }
     }
 
-    ResponseHeader() : status(nullptr) {}
+    ResponseHeader(Arena &arena)
+        : status(nullptr), nvector(ArenaAllocator<nghttp2_nv>(arena)) {}
   } response_headers;
 
 private:
-  /* unique identifier of streams per thread */
+  // sets content-type (if given) and content-length, and fills the route's
+  // cache if this stream is filling it
+  int submit_string_stream(StringStream *ss, const char *content_type);
+  // whether the response may fill a route's cache, see CachePolicy
+  bool is_shareable_response();
+  // wraps |ss| in a CompressStream if the policy and the client allow it
+  DataStream *compress_body(StringStream *ss, const char *content_type);
+
+  // more ranges in one request are ignored, the whole file is sent
+  constexpr static size_t max_byte_ranges = 16;
+  // whether the client's copy of |file| is current, see If-None-Match and
+  // If-Modified-Since
+  bool not_modified(const FileEntry &file);
+  // ranges of |file| requested by a GET, nullopt for all of it
+  std::optional<std::vector<util::ByteRange>>
+  requested_ranges(const FileEntry &file);
+
+  /* handle in the worker's stream slab, unique per thread and never
+   * resolves once the stream is destroyed */
   uint64_t serial_;
 
   HttpSession *session_;
@@ -235,15 +284,23 @@ private:
 
   int32_t id_;
 
-  util::MemBlock<512> mem_block_;
-
-  std::variant<std::monostate, StringStream, FileStream, EventStream>
+  std::variant<std::monostate, StringStream, FileStream, ByteRangesStream,
+               EventStream>
       data_stream_store_;
 
   DataStream *data_stream_ = nullptr;
+  // static file being sent, its header values are referenced
+  std::shared_ptr<FileEntry> static_file_;
+  // wraps the body in data_stream_store_ when the response is compressed
+  std::optional<CompressStream> compress_stream_;
 
   Task<> coro_handler_;
 
+  // cache the response fills, the key is allocated from arena_
+  ResponseCache *cache_ = nullptr;
+  std::string_view cache_key_;
+  bool cache_refresh_ = false;
+
   bool prepared_response_ = false;
 };
 
@@ -1,4 +1,5 @@
 #include "stringstream.h"
+#include "httpsession.h"
 #include "stream.h"
 #include <nghttp2/nghttp2.h>
 
@@ -13,7 +14,7 @@ StringStream::StringStream(std::string &&str) {
   end_ = beg_ + data.size();
 }
 
-StringStream::StringStream(std::string_view str) {
+StringStream::StringStream(std::string_view str) : owned_(false) {
   beg_ = last_ = str.data();
   end_ = beg_ + str.size();
 }
@@ -25,11 +26,40 @@ StringStream::StringStream(db::ResultString &&res) {
   end_ = beg_ + data.size();
 }
 
-int StringStream::send(Stream *stream, size_t length) {
-  auto wb = stream->get_buffer();
+StringStream::StringStream(std::shared_ptr<const std::string> str) {
+  beg_ = last_ = str->data();
+  end_ = beg_ + str->size();
+  data_ = std::move(str);
+}
+
+StringStream::~StringStream() {
+  if (queue_) {
+    queue_->keep_alive(std::move(data_));
+  }
+}
+
+size_t StringStream::buffer_usage(Stream *stream, size_t length) {
+  return owned_ && stream->get_session()->should_reference(length) ? 0
+                                                                   : length;
+}
+
+std::string_view StringStream::read(size_t length) {
+  length = std::min<size_t>(length, end_ - last_);
+  std::string_view data(last_, length);
+  last_ += length;
+  return data;
+}
 
+int StringStream::send(Stream *stream, size_t length) {
   assert(last_ + length <= end_);
-  wb->write_full(last_, length);
+
+  auto session = stream->get_session();
+  if (owned_ && session->should_reference(length)) {
+    session->queue_ref(last_, length);
+    queue_ = session->get_output_queue();
+  } else {
+    stream->get_buffer()->write_full(last_, length);
+  }
   last_ += length;
 
   return 0;
@@ -7,25 +7,39 @@
 #include <variant>
 
 #include "dbresult.h"
+#include "outputqueue.h"
 
 namespace hm {
 
 class StringStream : public DataStream {
 
 public:
+  // |str| is not owned and must outlive the stream (arena or static memory),
+  // so it is always copied to the write buffer
   StringStream(std::string_view str);
   StringStream(std::string &&str);
   StringStream(db::ResultString &&res);
+  // shared with other streams, e.g. a cached response
+  StringStream(std::shared_ptr<const std::string> str);
   StringStream(const std::string &) = delete;
+  ~StringStream();
 
   int send(Stream *stream, size_t length) override;
+  size_t buffer_usage(Stream *stream, size_t length) override;
+
+  std::string_view view() const { return {beg_, end_}; }
+  std::string_view read(size_t length) override;
 
   size_t length() override { return end_ - beg_; }
   size_t offset() override { return last_ - beg_; }
   std::pair<size_t, bool> remaining() override { return {end_ - last_, true}; }
 
 private:
-  std::variant<std::string, db::ResultString> data_;
+  OutputQueue::Storage data_;
   const char *beg_, *last_, *end_;
+  // set once data is queued by reference, data_ is handed over to it when
+  // this stream goes away before the queue is written
+  OutputQueue *queue_ = nullptr;
+  bool owned_ = true;
 };
 } // namespace hm
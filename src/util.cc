@@ -11,6 +11,7 @@
 #include "util.h"
 
 #include <cassert>
+#include <charconv>
 #include <iostream>
 
 namespace hm::util {
@@ -86,262 +87,139 @@ bool streq_l(const std::string_view &a, const std::string_view &b,
   return streq_l(a, {b.data(), blen});
 }
 
-HttpHeader lookup_header(std::string_view name) {
-  using enum HttpHeader;
-  switch (name.size()) {
-  case 2:
-    switch (name[1]) {
-    case 'e':
-      if (streq_l("t", name, 1)) {
-        return TE;
-      }
-      break;
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+// whole of |s| as a number
+static std::optional<size_t> parse_size(std::string_view s) {
+  size_t n;
+  auto end = s.data() + s.size();
+  auto [ptr, ec] = std::from_chars(s.data(), end, n);
+  if (s.empty() || ec != std::errc() || ptr != end) {
+    return std::nullopt;
+  }
+  return n;
+}
+
+bool etag_matches(std::string_view header, std::string_view etag) {
+  // weakness is ignored
+  if (etag.starts_with("W/")) {
+    etag.remove_prefix(2);
+  }
+  while (true) {
+    header = trim(header);
+    while (header.starts_with(',')) {
+      header = trim(header.substr(1));
     }
-    break;
-  case 3:
-    switch (name[2]) {
-    case 'a':
-      if (util::streq_l("vi", name, 2)) {
-        return VIA;
-      }
-      break;
+    if (header.empty()) {
+      return false;
     }
-    break;
-  case 4:
-    switch (name[3]) {
-    case 'e':
-      if (util::streq_l("dat", name, 3)) {
-        return DATE;
-      }
-      break;
-    case 'k':
-      if (util::streq_l("lin", name, 3)) {
-        return LINK;
-      }
-      break;
-    case 't':
-      if (util::streq_l("hos", name, 3)) {
-        return HOST;
-      }
-      break;
+    if (header.front() == '*') {
+      return true;
     }
-    break;
-  case 5:
-    switch (name[4]) {
-    case 'h':
-      if (util::streq_l(":pat", name, 4)) {
-        return pPATH;
-      }
-      break;
-    case 't':
-      if (util::streq_l(":hos", name, 4)) {
-        return HOST;
-      }
-      break;
+    if (header.starts_with("W/")) {
+      header.remove_prefix(2);
     }
-    break;
-  case 6:
-    switch (name[5]) {
-    case 'e':
-      if (util::streq_l("cooki", name, 5)) {
-        return COOKIE;
-      }
-      break;
-    case 'r':
-      if (util::streq_l("serve", name, 5)) {
-        return SERVER;
-      }
-      break;
-    case 't':
-      if (util::streq_l("expec", name, 5)) {
-        return EXPECT;
-      }
-      break;
-    }
-    break;
-  case 7:
-    switch (name[6]) {
-    case 'c':
-      if (util::streq_l("alt-sv", name, 6)) {
-        return ALT_SVC;
-      }
-      break;
-    case 'd':
-      if (util::streq_l(":metho", name, 6)) {
-        return pMETHOD;
-      }
-      break;
-    case 'e':
-      if (util::streq_l(":schem", name, 6)) {
-        return pSCHEME;
-      }
-      if (util::streq_l("upgrad", name, 6)) {
-        return UPGRADE;
-      }
-      break;
-    case 'r':
-      if (util::streq_l("traile", name, 6)) {
-        return TRAILER;
-      }
-      break;
-    case 's':
-      if (util::streq_l(":statu", name, 6)) {
-        return pSTATUS;
-      }
-      break;
+    // quoted, may contain commas
+    if (!header.starts_with('"')) {
+      return false;
     }
-    break;
-  case 8:
-    switch (name[7]) {
-    case 'n':
-      if (util::streq_l("locatio", name, 7)) {
-        return LOCATION;
-      }
-      break;
+    auto end = header.find('"', 1);
+    if (end == header.npos) {
+      return false;
     }
-    break;
-  case 9:
-    switch (name[8]) {
-    case 'd':
-      if (util::streq_l("forwarde", name, 8)) {
-        return FORWARDED;
-      }
-      break;
-    case 'l':
-      if (util::streq_l(":protoco", name, 8)) {
-        return pPROTOCOL;
-      }
-      break;
+    if (header.substr(0, end + 1) == etag) {
+      return true;
     }
-    break;
-  case 10:
-    switch (name[9]) {
-    case 'a':
-      if (util::streq_l("early-dat", name, 9)) {
-        return EARLY_DATA;
-      }
-      break;
-    case 'e':
-      if (util::streq_l("keep-aliv", name, 9)) {
-        return KEEP_ALIVE;
-      }
-      break;
-    case 'n':
-      if (util::streq_l("connectio", name, 9)) {
-        return CONNECTION;
-      }
-      break;
-    case 't':
-      if (util::streq_l("user-agen", name, 9)) {
-        return USER_AGENT;
-      }
-      break;
-    case 'y':
-      if (util::streq_l(":authorit", name, 9)) {
-        return pAUTHORITY;
-      }
-      break;
-    }
-    break;
-  case 12:
-    switch (name[11]) {
-    case 'e':
-      if (util::streq_l("content-typ", name, 11)) {
-        return CONTENT_TYPE;
-      }
-      break;
+    header.remove_prefix(end + 1);
+  }
+}
+
+std::optional<std::vector<ByteRange>>
+parse_range(std::string_view header, size_t size, size_t max_ranges) {
+  header = trim(header);
+  constexpr std::string_view unit = "bytes=";
+  if (header.size() < unit.size() ||
+      !streq_l(header.substr(0, unit.size()), unit)) {
+    return std::nullopt;
+  }
+  header.remove_prefix(unit.size());
+
+  std::vector<ByteRange> ranges;
+  size_t count = 0;
+  while (!header.empty()) {
+    auto comma = header.find(',');
+    auto spec = trim(header.substr(0, comma));
+    header.remove_prefix(comma == header.npos ? header.size() : comma + 1);
+    if (spec.empty()) {
+      continue;
     }
-    break;
-  case 13:
-    switch (name[12]) {
-    case 'l':
-      if (util::streq_l("cache-contro", name, 12)) {
-        return CACHE_CONTROL;
-      }
-      break;
+    if (++count > max_ranges) {
+      return std::nullopt;
     }
-    break;
-  case 14:
-    switch (name[13]) {
-    case 'h':
-      if (util::streq_l("content-lengt", name, 13)) {
-        return CONTENT_LENGTH;
-      }
-      break;
-    case 's':
-      if (util::streq_l("http2-setting", name, 13)) {
-        return HTTP2_SETTINGS;
-      }
-      break;
+
+    auto dash = spec.find('-');
+    if (dash == spec.npos) {
+      return std::nullopt;
     }
-    break;
-  case 15:
-    switch (name[14]) {
-    case 'e':
-      if (util::streq_l("accept-languag", name, 14)) {
-        return ACCEPT_LANGUAGE;
-      }
-      break;
-    case 'g':
-      if (util::streq_l("accept-encodin", name, 14)) {
-        return ACCEPT_ENCODING;
+    auto first = spec.substr(0, dash);
+    auto last = spec.substr(dash + 1);
+
+    if (first.empty()) {
+      // suffix, the last |n| bytes
+      auto n = parse_size(last);
+      if (!n) {
+        return std::nullopt;
       }
-      break;
-    case 'r':
-      if (util::streq_l("x-forwarded-fo", name, 14)) {
-        return X_FORWARDED_FOR;
+      if (*n > 0 && size > 0) {
+        auto length = std::min(*n, size);
+        ranges.push_back({size - length, length});
       }
-      break;
+      continue;
     }
-    break;
-  case 16:
-    switch (name[15]) {
-    case 'n':
-      if (util::streq_l("proxy-connectio", name, 15)) {
-        return PROXY_CONNECTION;
-      }
-      break;
+
+    auto begin = parse_size(first);
+    if (!begin) {
+      return std::nullopt;
     }
-    break;
-  case 17:
-    switch (name[16]) {
-    case 'e':
-      if (util::streq_l("if-modified-sinc", name, 16)) {
-        return IF_MODIFIED_SINCE;
+    auto end = size;
+    if (!last.empty()) {
+      auto n = parse_size(last);
+      if (!n || *n < *begin) {
+        return std::nullopt;
       }
-      break;
-    case 'g':
-      if (util::streq_l("transfer-encodin", name, 16)) {
-        return TRANSFER_ENCODING;
-      }
-      break;
-    case 'o':
-      if (util::streq_l("x-forwarded-prot", name, 16)) {
-        return X_FORWARDED_PROTO;
-      }
-      break;
-    case 'y':
-      if (util::streq_l("sec-websocket-ke", name, 16)) {
-        return SEC_WEBSOCKET_KEY;
-      }
-      break;
+      end = *n < size ? *n + 1 : size;
     }
-    break;
-  case 20:
-    switch (name[19]) {
-    case 't':
-      if (util::streq_l("sec-websocket-accep", name, 19)) {
-        return SEC_WEBSOCKET_ACCEPT;
-      }
-      break;
+    if (*begin < size) {
+      ranges.push_back({*begin, end - *begin});
     }
-    break;
   }
-  return eNOTFOUND;
-}
+  if (count == 0) {
+    return std::nullopt;
+  }
 
-HttpHeader lookup_header(const uint8_t *name, size_t namelen) {
-  return lookup_header({reinterpret_cast<const char *>(name), namelen});
+  std::sort(ranges.begin(), ranges.end(),
+            [](auto &a, auto &b) { return a.offset < b.offset; });
+  std::vector<ByteRange> merged;
+  for (auto &range : ranges) {
+    if (!merged.empty() &&
+        range.offset <= merged.back().offset + merged.back().length) {
+      auto &back = merged.back();
+      back.length =
+          std::max(back.offset + back.length, range.offset + range.length) -
+          back.offset;
+    } else {
+      merged.push_back(range);
+    }
+  }
+  return merged;
 }
 
 static int count_leap_year(int y) {
@@ -648,27 +526,6 @@ std::string to_json(PGresult *res) {
   return "{}";
 }
 
-std::optional<std::string_view> get_cookie(std::string_view cookies,
-                                           std::string_view key) {
-  for (;;) {
-    auto kbeg = cookies.find_first_not_of(' ');
-    auto kend = cookies.find_first_of('=');
-    auto k = cookies.substr(kbeg, kend);
-
-    auto vbeg = kend + 1;
-    auto vend = cookies.find_first_of(";", vbeg);
-    auto v = cookies.substr(vbeg, vend);
-    if (streq_l(k, key)) {
-      return v;
-    }
-    if (vend == cookies.npos) {
-      break;
-    }
-    cookies = cookies.substr(vend + 1);
-  }
-  return std::nullopt;
-}
-
 void append_quoted_string(std::string_view sv, std::string &ret_) {
   if (!std::any_of(sv.begin(), sv.end(), [](char c) {
         auto u = static_cast<unsigned char>(c);
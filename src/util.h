@@ -12,12 +12,16 @@
 #include <nghttp2/nghttp2.h>
 #include <openssl/ssl.h>
 
+#include "arena.h"
+#include "httpheader.h"
+
 #include <algorithm>
 #include <array>
 #include <cmath>
 #include <ctime>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <ranges>
 #include <vector>
 
@@ -57,51 +61,6 @@ int make_socket_nonblocking(int fd);
 bool streq_l(const std::string_view &a, const std::string_view &b);
 bool streq_l(const std::string_view &a, const std::string_view &b, size_t blen);
 
-enum class HttpHeader {
-  pAUTHORITY,
-  pHOST,
-  pMETHOD,
-  pPATH,
-  pPROTOCOL,
-  pSCHEME,
-  pSTATUS,
-  ACCEPT_ENCODING,
-  ACCEPT_LANGUAGE,
-  ALT_SVC,
-  CACHE_CONTROL,
-  CONNECTION,
-  CONTENT_LENGTH,
-  CONTENT_TYPE,
-  COOKIE,
-  DATE,
-  EARLY_DATA,
-  EXPECT,
-  FORWARDED,
-  HOST,
-  HTTP2_SETTINGS,
-  IF_MODIFIED_SINCE,
-  KEEP_ALIVE,
-  LINK,
-  LOCATION,
-  PROXY_CONNECTION,
-  SEC_WEBSOCKET_ACCEPT,
-  SEC_WEBSOCKET_KEY,
-  SERVER,
-  TE,
-  TRAILER,
-  TRANSFER_ENCODING,
-  UPGRADE,
-  USER_AGENT,
-  VIA,
-  X_FORWARDED_FOR,
-  X_FORWARDED_PROTO,
-  MAXIDX,
-  eNOTFOUND,
-};
-
-HttpHeader lookup_header(std::string_view name);
-HttpHeader lookup_header(const uint8_t *name_, size_t namelen);
-
 inline nghttp2_nv make_nv(std::string_view n, std::string_view v,
                           std::pair<bool, bool> copy = {false, false},
                           bool never_indexed = false) {
@@ -114,52 +73,32 @@ inline nghttp2_nv make_nv(std::string_view n, std::string_view v,
                              ((!copy.second) * NGHTTP2_NV_FLAG_NO_COPY_VALUE))};
 }
 
-// Initially keeps a stack allocated buffer
-template <size_t N> class MemBlock {
-public:
-  MemBlock() {}
-  ~MemBlock() {
-    for (int i = 0; i < add_.size(); i++) {
-      free(add_[i]);
-    }
-  }
+// str must be nullterminated
+time_t parse_http_date(const char *str);
 
-  void *alloc(size_t n) {
-    // ScopeDebug sc("MemBlock::alloc");
+// whether the If-None-Match list |header| matches the entity tag |etag|,
+// weak comparison
+bool etag_matches(std::string_view header, std::string_view etag);
 
-    // std::cerr << "requested alloc size: " << n << std::endl;
-    if (n + pos <= N) {
-      void *p = data_.data() + pos;
-      pos += n;
-      // std::cerr << "memory dump: " << std::endl;
-      // std::cerr << std::string_view((char *)data_.data(), pos) << std::endl;
-      return p;
-    }
-    // std::cerr << "dynamic allocating" << std::endl;
-    auto rt = malloc(n);
-    add_.push_back(rt);
-    return rt;
-  }
-
-private:
-  size_t pos = 0;
-  std::array<uint8_t, N> data_;
-  // additional memory
-  std::vector<void *> add_;
+struct ByteRange {
+  size_t offset;
+  size_t length;
 };
 
-// str must be nullterminated
-time_t parse_http_date(const char *str);
+// Ranges of a "bytes=" Range header for a representation of |size| bytes,
+// sorted with overlapping ones merged. nullopt if the header is invalid or
+// has more than |max_ranges| ranges, it is ignored then. Empty if no range
+// is satisfiable.
+std::optional<std::vector<ByteRange>>
+parse_range(std::string_view header, size_t size, size_t max_ranges);
 
 // out must own |src.size() * 3 + 1| bytes of memory
 std::string_view percent_decode(const std::string_view &src, char *out);
 std::string percent_decode(const std::string_view &src);
 
-template <size_t N>
-std::string_view percent_decode(const std::string_view &src,
-                                MemBlock<N> &memblock) {
-  char *out = static_cast<char *>(memblock.alloc(src.size() + 1));
-  return percent_decode(src, out);
+inline std::string_view percent_decode(const std::string_view &src,
+                                       Arena &arena) {
+  return percent_decode(src, arena.alloc_string(src.size()));
 }
 
 /* Conditional logic w/ lookup tables to check if id is banned */
@@ -174,31 +113,14 @@ inline bool check_h2_is_selected(const std::string_view &proto) {
   return proto == "h2" || proto == "h2-14" || proto == "h2-16";
 }
 
-template <size_t N>
-inline std::string_view to_string(int64_t n, MemBlock<N> &memblock) {
-  size_t size = 2;
-  auto n_ = n;
-  while (n_) {
-    n_ /= 10;
-    size += 1;
-  }
-  char *out = static_cast<char *>(memblock.alloc(size));
-  std::snprintf(out, size, "%li", n);
-  return out;
+inline std::string_view to_string(int64_t n, Arena &arena) {
+  char *out = arena.alloc_string(20);
+  return {out, (size_t)std::snprintf(out, 21, "%li", n)};
 }
 
-template <size_t N>
-inline std::string_view to_string(uint64_t n, MemBlock<N> &memblock) {
-  size_t size = 2;
-  auto n_ = n;
-  while (n_) {
-    n_ /= 10;
-    size += 1;
-  }
-
-  char *out = static_cast<char *>(memblock.alloc(size));
-  std::snprintf(out, size, "%lu", n);
-  return out;
+inline std::string_view to_string(uint64_t n, Arena &arena) {
+  char *out = arena.alloc_string(20);
+  return {out, (size_t)std::snprintf(out, 21, "%lu", n)};
 }
 
 inline std::string_view to_string_view(nghttp2_rcbuf *rcbuf) {
@@ -270,11 +192,8 @@ inline void hexdump(FILE *out, const uint8_t *src, size_t len) {
 std::string http_date(time_t t);
 char *http_date(time_t t, char *res);
 
-template <size_t N>
-inline std::string_view http_date(time_t t, MemBlock<N> &memblock) {
-  char *out = static_cast<char *>(memblock.alloc(29));
-  out[0] = '\0';
-  return {http_date(t, out), 29};
+inline std::string_view http_date(time_t t, Arena &arena) {
+  return {http_date(t, arena.alloc_string(29)), 29};
 }
 
 inline std::string http_date(time_t t) {
@@ -286,9 +205,6 @@ inline std::string http_date(time_t t) {
 
 std::string to_json(PGresult *result);
 
-std::optional<std::string_view> get_cookie(std::string_view cookies,
-                                           std::string_view key);
-
 void append_quoted_string(std::string_view sv, std::string &ret_);
 
 inline std::string as_string(std::string_view sv) {
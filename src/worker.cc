@@ -14,27 +14,61 @@
 namespace hm {
 
 Worker::Worker(Server *server)
-    : server_(server), queued_fds_(100), dbsession_(nullptr) {
+    : server_(server), queued_fds_(100), dbsession_(nullptr),
+      io_pool_(server->config_.io_threads),
+      wbuf_pool_(server->config_.huge_pages),
+      rbuf_pool_(server->config_.huge_pages),
+      h2_pool_(stats_.h2_mem_allocs, stats_.h2_mem_large_allocs) {
   // initialise new event loop
   loop_ = ev_loop_new(ev_recommended_backends());
   // initialise watcher to send new socket events from main thread
   ev_async_init(&async_watcher_, async_acceptcb);
   // initialise watcher to cancel event loop
   ev_async_init(&cancel_watcher_, async_cancelcb);
-  // initialise periodic watcher to check health
-  // ev_periodic_init(&periodic_watcher_, periodic_cb, 0., 30., nullptr);
+  // initialise watcher to run functions posted by other threads
+  ev_async_init(&post_watcher_, async_postcb);
+  // initialise periodic watcher for housekeeping
+  ev_periodic_init(&periodic_watcher_, periodic_cb, 0., 30., nullptr);
+  // initialise watchers marking the thread online/offline for Rcu, online
+  // before any other callback of an iteration runs
+  ev_check_init(&check_watcher_, checkcb);
+  ev_set_priority(&check_watcher_, EV_MAXPRI);
+  ev_prepare_init(&prepare_watcher_, preparecb);
+  ev_set_priority(&prepare_watcher_, EV_MINPRI);
 
   async_watcher_.data = this;
   cancel_watcher_.data = this;
+  post_watcher_.data = this;
   periodic_watcher_.data = this;
+  check_watcher_.data = this;
+  prepare_watcher_.data = this;
   ev_async_start(loop_, &async_watcher_);
   ev_async_start(loop_, &cancel_watcher_);
-  // ev_periodic_start(loop_, &periodic_watcher_);
+  ev_async_start(loop_, &post_watcher_);
+  ev_periodic_start(loop_, &periodic_watcher_);
+  ev_check_start(loop_, &check_watcher_);
+  ev_prepare_start(loop_, &prepare_watcher_);
+
+  server_->rcu_.add_reader(&rcu_reader_);
 
   nghttp2_session_callbacks_new(&callbacks_);
   HttpSession::fill_callback(callbacks_);
 
   nghttp2_option_new(&options_);
+
+  h2_mem_.mem_user_data = &h2_pool_;
+  h2_mem_.malloc = [](size_t size, void *pool) {
+    return static_cast<SizeClassPool *>(pool)->malloc(size);
+  };
+  h2_mem_.free = [](void *ptr, void *pool) {
+    static_cast<SizeClassPool *>(pool)->free(ptr);
+  };
+  h2_mem_.calloc = [](size_t nmemb, size_t size, void *pool) {
+    return static_cast<SizeClassPool *>(pool)->calloc(nmemb, size);
+  };
+  h2_mem_.realloc = [](void *ptr, size_t size, void *pool) {
+    return static_cast<SizeClassPool *>(pool)->realloc(ptr, size);
+  };
 }
 
 Worker::~Worker() {
@@ -44,6 +78,8 @@ Worker::~Worker() {
       th_->join();
     }
   }
+  // reads in flight post their completion to loop_
+  io_pool_.stop();
   // need to destroy sessions first which use loop_
   sessions_.clear();
   if (dbsession_) {
@@ -51,8 +87,8 @@ Worker::~Worker() {
   }
   nghttp2_session_callbacks_del(callbacks_);
   nghttp2_option_del(options_);
-  files_.clear();
   ev_loop_destroy(loop_);
+  server_->rcu_.remove_reader(&rcu_reader_);
 }
 
 void Worker::cancel() {
@@ -83,11 +119,52 @@ void Worker::async_cancelcb(struct ev_loop *loop, ev_async *watcher,
   ev_break(self->loop_, EVBREAK_ALL);
 }
 
+void Worker::async_postcb(struct ev_loop *loop, ev_async *watcher,
+                          int revents) {
+  auto self = static_cast<Worker *>(watcher->data);
+
+  std::vector<std::function<void()>> posted;
+  {
+    std::lock_guard lock(self->post_mutex_);
+    posted.swap(self->posted_);
+  }
+  for (auto &fn : posted) {
+    fn();
+  }
+}
+
+void Worker::post(std::function<void()> &&fn) {
+  {
+    std::lock_guard lock(post_mutex_);
+    posted_.push_back(std::move(fn));
+  }
+  ev_async_send(loop_, &post_watcher_);
+}
+
+void Worker::checkcb(struct ev_loop *loop, ev_check *watcher, int revents) {
+  auto self = static_cast<Worker *>(watcher->data);
+  self->server_->rcu_.online(&self->rcu_reader_);
+}
+
+void Worker::preparecb(struct ev_loop *loop, ev_prepare *watcher,
+                       int revents) {
+  auto self = static_cast<Worker *>(watcher->data);
+  self->server_->rcu_.offline(&self->rcu_reader_);
+}
+
 void Worker::periodic_cb(struct ev_loop *loop, ev_periodic *watcher,
                          int revents) {
-  // auto self = static_cast<Worker *>(watcher->data);
+  auto self = static_cast<Worker *>(watcher->data);
   // std::cerr << "thread " << std::this_thread::get_id() << " is alive"
   //           << std::endl;
+
+  // give back I/O buffers left over from past load peaks
+  self->wbuf_pool_.trim();
+  self->rbuf_pool_.trim();
+  // and nghttp2 memory left over from past stream bursts
+  self->h2_pool_.trim();
+  // free what was retired by workers that went idle since
+  self->server_->rcu_.collect();
 }
 
 struct ssl_ctx_st *Worker::get_ssl_context() {
@@ -96,8 +173,12 @@ struct ssl_ctx_st *Worker::get_ssl_context() {
 
 void Worker::run() {
   started_ = true;
-  th_ = std::make_unique<std::thread>(
-      [](struct ev_loop *loop) { ev_run(loop, 0); }, loop_);
+  th_ = std::make_unique<std::thread>([this] {
+    if (server_->config_.worker_arenas) {
+      arena_ = alloc::bind_thread_arena(server_->config_.arena);
+    }
+    ev_run(loop_, 0);
+  });
   workers_.emplace(th_->get_id(), this);
 }
 
@@ -105,8 +186,7 @@ void Worker::accept_connection(int fd) {
   util::make_socket_nodelay(fd);
   auto ssl = HttpSession::create_ssl_session(get_ssl_context(), fd);
   if (ssl) {
-    auto &session = sessions_.emplace_front(this, fd, std::move(ssl));
-    session.itr_ = sessions_.begin();
+    sessions_.emplace(this, fd, std::move(ssl));
   } else {
     std::cerr << "Failed to create ssl session. Rejecting connection."
               << std::endl;
@@ -115,70 +195,48 @@ void Worker::accept_connection(int fd) {
 }
 
 void Worker::remove_session(HttpSession *session) {
-  sessions_.erase(session->itr_);
+  sessions_.destroy(session);
 }
 
-void Worker::remove_static_file(FileEntry *file) {
-  files_.erase(file->relpath());
-}
+std::shared_ptr<FileEntry>
+Worker::get_static_file(const std::string_view &path,
+                        const AcceptEncoding &accept, bool relative,
+                        bool watch) {
+  auto &files = *server_->static_files_;
+  // read first, a file added during the lookup invalidates the miss
+  auto generation = files.generation();
+  auto file = files.find(path, accept);
+  if (file || relative) {
+    // the static directory is watched, the table has all of its files
+    return file;
+  }
 
-FileEntry *Worker::add_static_file(std::string path, bool watch) {
-  if (access(path.c_str(), R_OK) != 0) {
+  // file outside of it, try to add it and the precompressed variants
+  size_t probes = 1 + accept.accepts(ContentEncoding::BR) +
+                  accept.accepts(ContentEncoding::GZIP);
+  auto now = ev_now(loop_);
+  if (negative_cache_.contains(path, generation, now)) {
+    stats_.static_negative_hits.inc();
+    stats_.static_syscalls_saved.inc(probes);
     return nullptr;
   }
-  auto fs = FileEntry::create(std::move(path), this, watch);
-  if (fs) {
-    auto *ptr = fs.get();
-    // use relative path as key, including opening /
-    auto relpath = fs->relpath();
-    // std::cout << "Serving static file: " << std::left << std::setw(40)
-    //           << relpath << " [" << std::left << std::setw(40) << fs->path()
-    //           << "]" << std::endl;
-    files_.emplace(relpath, std::move(fs));
-
-    return ptr;
+
+  std::vector<std::string> paths;
+  paths.emplace_back(path);
+  if (accept.accepts(ContentEncoding::BR)) {
+    paths.push_back(paths[0] + ".br");
   }
-  return nullptr;
-}
-
-FileEntry *Worker::get_static_file(const std::string_view &path,
-                                   bool prefer_compressed, bool relative,
-                                   bool watch) {
-  auto [beg, end] = files_.equal_range(path);
-  FileEntry *ret = nullptr;
-  for (auto itr = beg; itr != end; ++itr) {
-    ret = itr->second.get();
-    if (prefer_compressed && ret->compressed()) {
-      return ret;
-    }
-    if (!prefer_compressed && !ret->compressed()) {
-      return ret;
-    }
+  if (accept.accepts(ContentEncoding::GZIP)) {
+    paths.push_back(paths[0] + ".gz");
   }
-  if (!ret) {
-    // file doesn't exist yet
-    // try to add it
-    if (relative) {
-      ret = add_static_file(server_->static_root_ + std::string(path), watch);
-    } else {
-      ret = add_static_file(std::string(path), watch);
-    }
 
-    // also check if there is compressed files available
-
-    if (prefer_compressed) {
-      auto br = add_static_file(
-          server_->static_root_ + std::string(path) + ".br", watch);
-      if (br) {
-        return br;
-      }
-    }
+  if (files.add(std::move(paths), 0, watch).empty()) {
+    negative_cache_.insert(path, generation, now + negative_ttl);
+    return nullptr;
   }
-  return ret;
+  return files.find(path, accept);
 }
 
-std::string_view Worker::get_static_root() { return server_->static_root_; }
-
 std::string_view Worker::get_cached_date() {
   auto now = ev_now(loop_);
   if (now >= date_cache_.cache_time) {
@@ -206,16 +264,15 @@ void Worker::start_db_session(const char *connect_string) {
 void Worker::restart_db_session() { start_db_session(dbconnection_string_); }
 
 bool Worker::is_stream_alive(uint64_t serial) {
-  return alive_streams_.contains(serial);
+  return streams_.get(serial) != nullptr;
 }
 
-void Worker::add_stream(Stream *stream) {
-  stream->serial_ = next_stream_serial_++;
-  alive_streams_.insert(stream->serial_);
-}
+Stream *Worker::get_stream(uint64_t serial) { return streams_.get(serial); }
 
-void Worker::remove_stream(Stream *stream) {
-  alive_streams_.erase(stream->serial_);
+Stream *Worker::create_stream(HttpSession *session, int32_t stream_id) {
+  return streams_.emplace(session, stream_id);
 }
 
+void Worker::destroy_stream(Stream *stream) { streams_.destroy(stream); }
+
 } // namespace hm
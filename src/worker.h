@@ -1,22 +1,30 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <deque>
+#include <functional>
 #include <limits>
-#include <list>
 #include <map>
 #include <mutex>
 #include <thread>
 #include <unordered_map>
-#include <unordered_set>
 
 #include <ev.h>
 #include <nghttp2/nghttp2.h>
 
+#include "bufferpool.h"
 #include "dbsession.h"
 #include "eventdispatcher.h"
 #include "filestream.h"
+#include "iopool.h"
+#include "mempool.h"
+#include "negativecache.h"
+#include "rcu.h"
 #include "server.h"
+#include "slab.h"
+#include "stats.h"
 #include "uuidgenerator.h"
 
 #include <readerwriterqueue.h>
@@ -25,6 +33,7 @@
 namespace hm {
 
 class HttpSession;
+class Stream;
 
 class Worker {
   friend class Server;
@@ -62,12 +71,9 @@ public:
 
   void remove_session(HttpSession *session);
 
-  void remove_static_file(FileEntry *file);
-
-  FileEntry *get_static_file(const std::string_view &rel_path,
-                             bool prefer_compressed, bool relative, bool watch);
-
-  std::string_view get_static_root();
+  std::shared_ptr<FileEntry> get_static_file(const std::string_view &rel_path,
+                                             const AcceptEncoding &accept,
+                                             bool relative, bool watch);
 
   std::string_view get_cached_date();
 
@@ -85,7 +91,21 @@ public:
 
   EventDispatcher *get_event_dispatcher() { return &event_dispatcher_; }
 
+  Stats &get_stats() { return stats_; }
+
+  CompressorPool *get_compressor_pool() { return &compressor_pool_; }
+
+  IoPool *get_io_pool() { return &io_pool_; }
+
+  // jemalloc arena the worker thread allocates from, -1 if none
+  int get_arena() { return arena_; }
+
   bool is_stream_alive(uint64_t serial);
+  // stream with handle |serial|, nullptr if it is gone
+  Stream *get_stream(uint64_t serial);
+
+  // runs |fn| on this worker's thread, callable from any thread
+  void post(std::function<void()> &&fn);
 
   void set_query_dir(const char *dir) {
     query_dir_ = dir;
@@ -95,30 +115,47 @@ public:
   }
 
 private:
-  void add_stream(Stream *stream);
-  void remove_stream(Stream *stream);
-
-  FileEntry *add_static_file(std::string path, bool watch);
+  Stream *create_stream(HttpSession *session, int32_t stream_id);
+  void destroy_stream(Stream *stream);
 
   static void async_acceptcb(struct ev_loop *loop, ev_async *watcher,
                              int revents);
   static void async_cancelcb(struct ev_loop *loop, ev_async *watcher,
                              int revents);
 
+  static void async_postcb(struct ev_loop *loop, ev_async *watcher,
+                           int revents);
+
   static void periodic_cb(struct ev_loop *loop, ev_periodic *watcher,
                           int revents);
 
+  // reads of shared data (see Rcu) happen between these two
+  static void checkcb(struct ev_loop *loop, ev_check *watcher, int revents);
+  static void preparecb(struct ev_loop *loop, ev_prepare *watcher,
+                        int revents);
+
 private:
   Server *server_;
   struct ev_loop *loop_;
   ev_periodic periodic_watcher_;
   ev_async async_watcher_;
   ev_async cancel_watcher_;
+  ev_async post_watcher_;
+  ev_check check_watcher_;
+  ev_prepare prepare_watcher_;
   std::unique_ptr<std::thread> th_;
   std::mutex mutex_;
   moodycamel::ReaderWriterQueue<int> queued_fds_;
 
-  std::list<HttpSession> sessions_;
+  std::mutex post_mutex_;
+  std::vector<std::function<void()>> posted_;
+
+  Rcu::Reader rcu_reader_;
+
+  // streams are owned by their sessions but allocated here, so their
+  // handles (Stream::serial()) can be checked after they are gone
+  Slab<Stream> streams_;
+  Slab<HttpSession> sessions_;
 
   const char *dbconnection_string_;
   const char *query_dir_ = nullptr;
@@ -128,8 +165,6 @@ private:
   nghttp2_session_callbacks *callbacks_;
   nghttp2_option *options_;
 
-  std::multimap<std::string_view, std::unique_ptr<FileEntry>> files_;
-
   struct DateCache {
     char mem[29];
     std::string_view date;
@@ -140,14 +175,35 @@ private:
     }
   } date_cache_;
 
-  uint64_t next_stream_serial_ = 0;
-  std::unordered_set<uint64_t> alive_streams_;
-
   bool started_ = false;
+  std::atomic<int> arena_ = -1;
 
   simdjson::ondemand::parser json_parser_;
   UUIDGenerator uuid_generator_;
 
   EventDispatcher event_dispatcher_;
+
+  Stats stats_;
+
+  CompressorPool compressor_pool_;
+
+  // seconds a miss outside the watched static directory is remembered
+  constexpr static double negative_ttl = 5.;
+  NegativeCache negative_cache_;
+
+  // reads of files not in the page cache
+  IoPool io_pool_;
+
+  BufferPool<WriteBuffer> wbuf_pool_;
+  BufferPool<ReadBuffer> rbuf_pool_;
+
+  // small queued ranges of a session are gathered here to be encrypted as
+  // one full TLS record (see HttpSession::flush_output)
+  constexpr static size_t tls_record_size = 16 * 1024;
+  std::array<uint8_t, tls_record_size> tls_record_;
+
+  // nghttp2 sessions of this worker allocate from here
+  SizeClassPool h2_pool_;
+  nghttp2_mem h2_mem_;
 };
 } // namespace hm